@@ -0,0 +1,213 @@
+/* Usage: demux_bench [MB]
+ *
+ * Demultiplex a synthetic V0 stream (stdout and stderr frames, as from
+ * prun) into /dev/null: the original prun loop, PIPE_BUF reads and a
+ * write per fragment, against libproxyfd.  No module needed, the stream
+ * is read from a memfd.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+
+#include "libproxyfd.h"
+
+#define COOKIE_OUT htonl(UINT32_C(0x3e0a0000))
+#define COOKIE_ERR htonl(UINT32_C(0x210a0000))
+
+static int outfd;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Frames of 1..512 bytes, a few up to 4000, a fifth of them stderr. */
+static int make_stream(size_t size, uint64_t *sum)
+{
+	char *buf = malloc(size), *p = buf;
+	int fd = memfd_create("stream", 0);
+
+	if (!buf || fd < 0)
+		err(EXIT_FAILURE, "make_stream");
+	srand(1);
+	*sum = 0;
+	while (p + 4 + 4000 <= buf + size) {
+		uint32_t len = rand() % 16 ? 1 + rand() % 512 : 1 + rand() % 4000;
+		uint32_t hdr = (rand() % 5 ? COOKIE_OUT : COOKIE_ERR) |
+		               htonl(len);
+
+		memcpy(p, &hdr, 4);
+		for (uint32_t i = 0; i < len; i++) {
+			p[4 + i] = 'a' + i % 26;
+			*sum += (unsigned char)p[4 + i];
+		}
+		p += 4 + len;
+	}
+	if (write(fd, buf, p - buf) != p - buf)
+		err(EXIT_FAILURE, "write");
+	free(buf);
+	return fd;
+}
+
+/* prun.c before libproxyfd */
+
+static void output(const char *buf, size_t size)
+{
+	ssize_t offset = 0;
+	while (offset != size) {
+		ssize_t st = write(outfd, buf + offset, size - offset);
+		if (st < 0) {
+			if (errno == EINTR) continue;
+			err(EXIT_FAILURE, "write");
+		}
+		offset += st;
+	}
+}
+
+static void error_highlight(uint32_t hdr, ssize_t state)
+{
+	if (*(const char *)&hdr != '!')
+		return;
+
+	if (state)
+		output("\e[31m", 5);
+	else
+		output("\e[0m", 4);
+}
+
+static void stream_forward(int fd, void(*callback)(uint32_t, ssize_t))
+{
+	ssize_t st;
+	ssize_t state = 0;
+	uint32_t hdr;
+	char buf[PIPE_BUF];
+
+	while ((st = read(fd, buf, sizeof(buf)))) {
+		ssize_t offset = 0;
+		if (st < 0) {
+			if (errno == EINTR) continue;
+			err(EXIT_FAILURE, "read");
+		}
+		while (offset != st) {
+			if (state > 0) {
+				ssize_t sz = st - offset < state ?
+				             st - offset : state;
+				output(buf + offset, sz);
+				offset += sz;
+				if ((state -= sz)) continue;
+			}
+			if (!state && callback)
+				callback(hdr, 0);
+			if (st - offset < 4 + state) {
+				memcpy((char *)&hdr - state, buf + offset, st - offset);
+				state -= st - offset;
+				break;
+			}
+			memcpy((char *)&hdr - state, buf + offset, 4 + state);
+			offset += 4 + state;
+			state = ntohl(hdr) & 0xffff;
+			if (callback)
+				callback(hdr, state);
+		}
+	}
+}
+
+/* prun.c with libproxyfd */
+
+static struct pfd_out out;
+static int red;
+static uint64_t lib_sum;
+static int verify;
+
+static void color(int on)
+{
+	if (red == on)
+		return;
+	pfd_out_add(&out, on ? "\e[31m" : "\e[0m", on ? 5 : 4);
+	red = on;
+}
+
+static void forward(void *arg, const struct pfd_frame *f,
+                    const char *data, size_t n)
+{
+	color(arg != NULL);
+	pfd_out_add(&out, data, n);
+	for (size_t i = 0; verify && i < n; i++)
+		lib_sum += (unsigned char)data[i];
+}
+
+static void flush(void *arg)
+{
+	color(0);
+	pfd_out_flush_cb(&out);
+}
+
+static void lib_forward(int fd, size_t bufsize)
+{
+	struct pfd_demux d;
+
+	if (pfd_demux_init(&d, fd, PROXYFD_HDR_V0, bufsize) ||
+	    pfd_demux_on(&d, COOKIE_OUT, forward, NULL) ||
+	    pfd_demux_on(&d, COOKIE_ERR, forward, &red))
+		err(EXIT_FAILURE, "pfd_demux_init");
+	pfd_out_init(&out, outfd);
+	d.flush = flush;
+	if (pfd_demux_run(&d))
+		err(EXIT_FAILURE, "read");
+	pfd_demux_free(&d);
+}
+
+int main(int argc, char **argv)
+{
+	size_t mb = argc > 1 ? atol(argv[1]) : 256;
+	uint64_t sum;
+	double t;
+	int fd;
+
+	if (!mb)
+		errx(EXIT_FAILURE, "bad size");
+	outfd = open("/dev/null", O_WRONLY);
+	if (outfd < 0)
+		err(EXIT_FAILURE, "/dev/null");
+	fd = make_stream(mb << 20, &sum);
+
+	lseek(fd, 0, SEEK_SET);
+	t = now();
+	stream_forward(fd, error_highlight);
+	t = now() - t;
+	printf("prun loop:        %8.1f MB/s\n", mb / t);
+
+	size_t sizes[] = { 64 << 10, 1 << 20 };
+	for (int i = 0; i < 2; i++) {
+		lseek(fd, 0, SEEK_SET);
+		t = now();
+		lib_forward(fd, sizes[i]);
+		t = now() - t;
+		printf("libproxyfd %4zuK: %8.1f MB/s\n", sizes[i] >> 10, mb / t);
+	}
+
+	/* untimed: every payload byte made it through */
+	verify = 1;
+	lseek(fd, 0, SEEK_SET);
+	lib_forward(fd, 0);
+	if (lib_sum != sum)
+		errx(EXIT_FAILURE, "payload checksum mismatch");
+
+	close(fd);
+	close(outfd);
+	return 0;
+}
@@ -0,0 +1,263 @@
+/* libproxyfd - demultiplexing pipes fed by proxies */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "libproxyfd.h"
+
+#define BUF_DEFAULT (1 << 20)
+
+int pfd_demux_init(struct pfd_demux *d, int fd, uint32_t hdr,
+                   size_t bufsize)
+{
+	if (hdr > PROXYFD_HDR_V1) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(d, 0, sizeof(*d));
+	d->fd = fd;
+	d->hdr = hdr;
+	d->size = bufsize ? bufsize : BUF_DEFAULT;
+	/* a header always fits, and so does a whole V0 frame */
+	if (d->size < 4 + 0xffff)
+		d->size = 4 + 0xffff;
+	d->buf = malloc(d->size);
+	return d->buf ? 0 : -1;
+}
+
+void pfd_demux_free(struct pfd_demux *d)
+{
+	free(d->buf);
+	d->buf = NULL;
+}
+
+int pfd_demux_on(struct pfd_demux *d, uint64_t key, pfd_frame_fn fn,
+                 void *arg)
+{
+	struct pfd_route *r;
+
+	if (key == ~(uint64_t)0) {
+		r = &d->any;
+	} else {
+		if (d->nroutes == PFD_ROUTES_MAX) {
+			errno = ENOSPC;
+			return -1;
+		}
+		r = &d->routes[d->nroutes++];
+	}
+	r->key = key;
+	r->fn = fn;
+	r->arg = arg;
+	return 0;
+}
+
+static const struct pfd_route *route(const struct pfd_demux *d,
+                                     uint64_t key)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nroutes; i++)
+		if (d->routes[i].key == key)
+			return &d->routes[i];
+	return &d->any;
+}
+
+static void deliver(struct pfd_demux *d, const char *data, size_t n)
+{
+	const struct pfd_route *r = route(d, d->cur.key);
+
+	d->cur.last = n == d->left || d->cur.truncated;
+	if (r->fn)
+		r->fn(r->arg, &d->cur, data, n);
+	d->cur.off += n;
+	d->left -= n;
+}
+
+/* Header at p, of at most avail bytes, into d->cur.  Returns the header
+ * size, 0 if incomplete. */
+static size_t parse_header(struct pfd_demux *d, const char *p, size_t avail)
+{
+	struct proxyfd_hdr_v1 h1;
+	uint32_t h0, info;
+	size_t hs;
+
+	if (d->hdr == PROXYFD_HDR_V0) {
+		if (avail < 4)
+			return 0;
+		memcpy(&h0, p, 4);
+		d->cur.key = h0 & ~htonl(0xffff);
+		d->cur.info = 0;
+		d->cur.len = ntohl(h0) & 0xffff;
+		hs = 4;
+	} else {
+		if (avail < sizeof(h1))
+			return 0;
+		memcpy(&h1, p, sizeof(h1));
+		info = be32toh(h1.info);
+		hs = sizeof(h1);
+		if (info & PROXYFD_HDR_TS)
+			hs += sizeof(struct proxyfd_hdr_ts);
+		if (avail < hs)
+			return 0;
+		d->cur.key = be64toh(h1.stream);
+		d->cur.info = info & 0xffffff;
+		d->cur.len = be32toh(h1.len);
+	}
+	d->cur.off = 0;
+	d->cur.truncated = 0;
+	d->left = d->cur.len;
+	return hs;
+}
+
+/* Dispatch whatever is complete in the buffer; returns bytes used.
+ * Frames come whole unless larger than the buffer. */
+static size_t scan(struct pfd_demux *d)
+{
+	const char *p = d->buf, *end = d->buf + d->len;
+
+	for (;;) {
+		size_t avail = end - p, n, hs;
+
+		if (!d->left) {
+			hs = parse_header(d, p, avail);
+			if (!hs)
+				break;
+			if (hs + d->cur.len > avail &&
+			    hs + d->cur.len <= d->size) {
+				/* header again once the rest is in */
+				d->left = 0;
+				break;
+			}
+			p += hs;
+			avail -= hs;
+			if (!d->left) {
+				deliver(d, p, 0);
+				continue;
+			}
+		}
+		n = avail < d->left ? avail : d->left;
+		if (!n)
+			break;
+		deliver(d, p, n);
+		p += n;
+	}
+	return p - d->buf;
+}
+
+/* End of file amid a frame: what there is of it goes out as its last
+ * piece, if the header made it. */
+static ssize_t truncated(struct pfd_demux *d)
+{
+	size_t hs = 0;
+
+	if (!d->left)
+		hs = parse_header(d, d->buf, d->len);
+	if (hs || d->left) {
+		d->cur.truncated = 1;
+		deliver(d, d->buf + hs, d->len - hs);
+		if (d->flush)
+			d->flush(d->flush_arg);
+	}
+	d->len = 0;
+	d->left = 0;
+	errno = EBADMSG;
+	return -1;
+}
+
+ssize_t pfd_demux_step(struct pfd_demux *d)
+{
+	size_t used;
+	ssize_t st;
+
+	do {
+		st = read(d->fd, d->buf + d->len, d->size - d->len);
+	} while (st < 0 && errno == EINTR);
+	if (!st && (d->len || d->left))
+		return truncated(d);
+	if (st <= 0)
+		return st;
+
+	d->len += st;
+	used = scan(d);
+	if (d->flush)
+		d->flush(d->flush_arg);
+	/* unparsed tail: part of a header, or a frame yet to come whole */
+	memmove(d->buf, d->buf + used, d->len - used);
+	d->len -= used;
+	return st;
+}
+
+int pfd_demux_run(struct pfd_demux *d)
+{
+	ssize_t st;
+
+	while ((st = pfd_demux_step(d)) > 0)
+		;
+	return st < 0 ? -1 : 0;
+}
+
+void pfd_out_init(struct pfd_out *o, int fd)
+{
+	o->fd = fd;
+	o->n = 0;
+}
+
+int pfd_out_add(struct pfd_out *o, const void *p, size_t len)
+{
+	struct iovec *last = o->n ? &o->iov[o->n - 1] : NULL;
+
+	if (!len)
+		return 0;
+	if (last && (char *)last->iov_base + last->iov_len == p) {
+		last->iov_len += len;
+		return 0;
+	}
+	if (o->n == PFD_OUT_IOV && pfd_out_flush(o))
+		return -1;
+	o->iov[o->n].iov_base = (void *)p;
+	o->iov[o->n].iov_len = len;
+	o->n++;
+	return 0;
+}
+
+int pfd_out_flush(struct pfd_out *o)
+{
+	struct iovec *iov = o->iov;
+	int n = o->n;
+
+	while (n) {
+		ssize_t st = writev(o->fd, iov, n);
+
+		if (st < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		/* short write: skip what went out */
+		while (n && (size_t)st >= iov->iov_len) {
+			st -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + st;
+			iov->iov_len -= st;
+		}
+	}
+	o->n = 0;
+	return 0;
+}
+
+void pfd_out_flush_cb(void *arg)
+{
+	if (pfd_out_flush(arg))
+		err(EXIT_FAILURE, "writev");
+}
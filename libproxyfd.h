@@ -0,0 +1,93 @@
+/* libproxyfd - demultiplexing pipes fed by proxies
+ *
+ * Reads the pipe in large chunks and hands every frame to the callback
+ * registered for its cookie (V0) or stream (V1), pointing into the read
+ * buffer: payloads are not copied.  Frames larger than the buffer come
+ * in pieces.  Output is batched with pfd_out, flushed once per chunk.
+ */
+#ifndef LIBPROXYFD_H
+#define LIBPROXYFD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "src/proxyfd.h"
+
+struct pfd_frame {
+	uint64_t key;    /* V0: cookie (header, length masked out); V1: stream */
+	uint32_t info;   /* V1: PROXYFD_HDR_* flags */
+	uint32_t len;    /* payload bytes, whole frame */
+	uint32_t off;    /* of this piece in the frame */
+	int      last;   /* last piece of the frame */
+	int      truncated; /* last piece, the pipe ended amid the frame */
+};
+
+/* data, n: piece of the payload at f->off */
+typedef void (*pfd_frame_fn)(void *arg, const struct pfd_frame *f,
+                             const char *data, size_t n);
+
+#define PFD_ROUTES_MAX 16
+
+struct pfd_demux {
+	int      fd;
+	uint32_t hdr;        /* PROXYFD_HDR_* */
+	char    *buf;
+	size_t   size, len;  /* buffer, bytes in it */
+
+	struct pfd_route {
+		uint64_t     key;
+		pfd_frame_fn fn;
+		void        *arg;
+	} routes[PFD_ROUTES_MAX];
+	unsigned int nroutes;
+	struct pfd_route any;  /* frames no route is for, fn may be NULL */
+
+	/* called once a chunk is done, before the buffer is reused */
+	void   (*flush)(void *arg);
+	void    *flush_arg;
+
+	/* frame being delivered in pieces */
+	struct pfd_frame cur;
+	size_t   left;
+};
+
+/* bufsize 0: 1MiB.  Returns 0 or -1 (errno set). */
+int pfd_demux_init(struct pfd_demux *d, int fd, uint32_t hdr,
+                   size_t bufsize);
+void pfd_demux_free(struct pfd_demux *d);
+
+/* Frames of key go to fn; key ~0 sets the default route. */
+int pfd_demux_on(struct pfd_demux *d, uint64_t key, pfd_frame_fn fn,
+                 void *arg);
+
+/* Read a chunk and dispatch the frames in it.  Returns bytes read, 0 at
+ * end of file, -1 on error (EINTR retried).  End of file amid a frame
+ * fails with EBADMSG, once; its data so far is delivered, the last piece
+ * flagged truncated. */
+ssize_t pfd_demux_step(struct pfd_demux *d);
+
+/* Until end of file or an error.  Returns 0 or -1. */
+int pfd_demux_run(struct pfd_demux *d);
+
+/* Output batched into a single writev() per flush. */
+#define PFD_OUT_IOV 1024
+
+struct pfd_out {
+	int          fd;
+	int          n;
+	struct iovec iov[PFD_OUT_IOV];
+};
+
+void pfd_out_init(struct pfd_out *o, int fd);
+
+/* p must stay valid until the next flush; pieces adjacent in memory
+ * are coalesced.  Returns 0 or -1. */
+int pfd_out_add(struct pfd_out *o, const void *p, size_t len);
+int pfd_out_flush(struct pfd_out *o);
+
+/* For pfd_demux.flush, arg is a struct pfd_out; errors are fatal. */
+void pfd_out_flush_cb(void *arg);
+
+#endif
@@ -18,38 +18,41 @@
 #include <errno.h>
 #include <string.h>
 
-struct request {
-	uint32_t flags;
-	uint32_t cookie;
-	uint32_t pipefd;
-};
+#include "src/proxyfd.h"
+#include "libproxyfd.h"
 
-#define PROXYFD_DEV_PATH "/dev/proxyfd"
+static struct pfd_out out;
+static int red;
 
-static void output(const char *buf, size_t size)
+static void output(const void *p, size_t len)
 {
-	ssize_t offset = 0;
-	while (offset != size) {
-		ssize_t st = write(STDOUT_FILENO, buf + offset, size - offset);
-		if (st < 0) {
-			if (errno == EINTR) continue;
-			err(EXIT_FAILURE, "write");
-		}
-		offset += st;
-	}
+	if (pfd_out_add(&out, p, len))
+		err(EXIT_FAILURE, "writev");
 }
 
-static void stream_forward(int fd, void(*callback)(uint32_t, ssize_t));
-
-static void error_highlight(uint32_t hdr, ssize_t state)
+/* Escapes on changes only; never left red while waiting. */
+static void color(int on)
 {
-	if (*(const char *)&hdr != '!')
+	if (red == on)
 		return;
-
-	if (state)
+	if (on)
 		output("\e[31m", 5);
 	else
 		output("\e[0m", 4);
+	red = on;
+}
+
+static void forward(void *arg, const struct pfd_frame *f,
+                    const char *data, size_t n)
+{
+	color(arg != NULL);
+	output(data, n);
+}
+
+static void flush(void *arg)
+{
+	color(0);
+	pfd_out_flush_cb(&out);
 }
 
 int main(int argc, char **argv)
@@ -59,7 +62,8 @@ int main(int argc, char **argv)
 	int devfd;
 	int proxyfd[2];
 	int status;
-	struct request r = { .flags = O_CLOEXEC };
+	struct proxy_req r = { .flags = O_CLOEXEC };
+	struct pfd_demux d;
 
 	if (argc == 1) {
 		printf("Usage: %s [COMMAND]...\n", argv[0]);
@@ -103,46 +107,21 @@ int main(int argc, char **argv)
 
 	close(proxyfd[0]);
 	close(proxyfd[1]);
-	stream_forward(pipefd[0], error_highlight);
+	if (pfd_demux_init(&d, pipefd[0], PROXYFD_HDR_V0, 0) ||
+	    pfd_demux_on(&d, ~(uint64_t)0, forward, NULL) ||
+	    pfd_demux_on(&d, htonl(UINT32_C(0x210a0000)), forward, &red))
+		err(EXIT_FAILURE, "pfd_demux_init");
+	pfd_out_init(&out, STDOUT_FILENO);
+	d.flush = flush;
+	while (pfd_demux_run(&d)) {
+		if (errno != EBADMSG)
+			err(EXIT_FAILURE, "read");
+		/* what there was of the last frame went out */
+		warnx("output ends amid a frame");
+	}
+	pfd_demux_free(&d);
 	while (wait(&status) < 0) {
 		if (errno == ECHILD) return EXIT_SUCCESS;
 	}
 	return WIFEXITED(status) ? WEXITSTATUS(status): EXIT_FAILURE;
 }
-
-static void stream_forward(int fd, void(*callback)(uint32_t, ssize_t))
-{
-	ssize_t st;
-	ssize_t state = 0;
-	uint32_t hdr;
-	char buf[PIPE_BUF];
-
-	while ((st = read(fd, buf, sizeof(buf)))) {
-		ssize_t offset = 0;
-		if (st < 0) {
-			if (errno == EINTR) continue;
-			err(EXIT_FAILURE, "read");
-		}
-		while (offset != st) {
-			if (state > 0) {
-				ssize_t sz = st - offset < state ?
-				             st - offset : state;
-				output(buf + offset, sz);
-				offset += sz;
-				if ((state -= sz)) continue;
-			}
-			if (!state && callback)
-				callback(hdr, 0);
-			if (st - offset < 4 + state) {
-				memcpy((char *)&hdr - state, buf + offset, st - offset);
-				state -= st - offset;
-				break;
-			}
-			memcpy((char *)&hdr - state, buf + offset, 4 + state);
-			offset += 4 + state;
-			state = ntohl(hdr) & 0xffff;
-			if (callback)
-				callback(hdr, state);
-		}
-	}
-}
@@ -4,6 +4,7 @@
 #include <linux/device.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
@@ -12,10 +13,21 @@
 #include <linux/mount.h>
 #include <asm/ioctls.h>
 #include <linux/version.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/compat.h>
+#include <linux/poll.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0)
 #include <linux/pseudo_fs.h>
 #endif
 
+#include "proxyfd.h"
+#include "proxy.h"
+
 #define DEVICE_NAME "proxyfd"
 #define CLASS_NAME  "proxyfd"
 
@@ -24,75 +36,498 @@ static struct class *class;
 static struct vfsmount *proxy_inode_mnt __read_mostly;
 static struct inode *proxy_inode_inode;
 
-struct proxy_req {
-	__u32 flags; /* O_CLOEXEC, O_NONBLOCK */
-	__u32 cookie;
-	__u32 pipefd;
-};
+static struct dentry *debugfs_dir;
+static atomic_t proxy_count = ATOMIC_INIT(0);
+static struct kmem_cache *proxy_ctx_cachep __read_mostly;
 
-struct proxy_ctx {
-	struct file *pipe;
-	__u32        cookie;
+static unsigned int max_proxies;
+module_param(max_proxies, uint, 0644);
+MODULE_PARM_DESC(max_proxies, "Most proxies open at a time, 0: no limit");
+
+DEFINE_PER_CPU(struct proxy_global_stats, proxy_global_stats);
+
+struct workqueue_struct *proxy_wq;
+
+static const char *const proxy_stat_names[PROXY_STAT_NR] = {
+	[PROXY_STAT_BYTES]   = "bytes",
+	[PROXY_STAT_FRAMES]  = "frames",
+	[PROXY_STAT_MERGED]  = "merged",
+	[PROXY_STAT_NEWBUFS] = "newbufs",
+	[PROXY_STAT_EAGAIN]  = "eagain",
+	[PROXY_STAT_WAIT_NS] = "wait_ns",
+	[PROXY_STAT_DROPPED] = "dropped",
+	[PROXY_STAT_RECYCLED] = "recycled",
 };
 
 /* proxy file methods */
 
-ssize_t pipe_framed_write(struct file *filep, struct iov_iter *from,
-                          __u32 cookie);
+/* Targets for the duration of an operation, proxy_targets_put them
+ * when done.  Retargeting swaps ctx->targets, operations in progress
+ * finish on the old ones. */
+static struct proxy_targets *proxy_targets_get(struct proxy_ctx *ctx)
+{
+	struct proxy_targets *ts;
+
+	/* ctx holds a reference until a grace period after the swap */
+	rcu_read_lock();
+	ts = rcu_dereference(ctx->targets);
+	refcount_inc(&ts->ref);
+	rcu_read_unlock();
+	return ts;
+}
+
+static void proxy_targets_free(struct proxy_targets *ts)
+{
+	unsigned int i;
+
+	for (i = 0; i < ts->n; i++) {
+		struct proxy_target *t = &ts->t[i];
+
+		remove_wait_queue(t->wq, &t->wait);
+		if (t->fp)
+			pipe_framed_detach(t);
+		fput(t->file);
+	}
+	kfree(ts);
+}
+
+static void proxy_targets_put(struct proxy_targets *ts)
+{
+	if (refcount_dec_and_test(&ts->ref))
+		proxy_targets_free(ts);
+}
+
+/* Target the next write goes to; peeking doesn't move round-robin on. */
+static struct proxy_target *proxy_pick(struct proxy_ctx *ctx,
+                                       struct proxy_targets *ts, bool peek)
+{
+	unsigned int i;
+
+	/* fan-out: the primary stands for the write */
+	if (ts->n == 1 || ctx->shard == PROXYFD_SHARD_TEE)
+		return &ts->t[0];
+
+	switch (ctx->shard) {
+	case PROXYFD_SHARD_CPU:
+		i = raw_smp_processor_id();
+		break;
+	case PROXYFD_SHARD_HASH:
+		i = hash_64(ctx->stream ^ ctx->cookie, 32);
+		break;
+	default:
+		i = peek ? atomic_read(&ctx->rr) :
+		           atomic_inc_return(&ctx->rr) - 1;
+		break;
+	}
+	return &ts->t[i % ts->n];
+}
 
 ssize_t proxy_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	struct proxy_ctx *ctx = iocb->ki_filp->private_data;
+	struct proxy_targets *ts = proxy_targets_get(ctx);
+	struct proxy_target *t;
+	ssize_t ret;
+
+	if (ctx->shard == PROXYFD_SHARD_TEE) {
+		ret = pipe_framed_tee(ctx, ts, iocb, from);
+	} else {
+		t = proxy_pick(ctx, ts, false);
+		if (t->ring)
+			ret = ring_framed_write(ctx, t, iocb, from);
+		else
+			ret = pipe_framed_write(ctx, t, iocb, from);
+	}
+	proxy_targets_put(ts);
+	return ret;
+}
+
+/* splice() and sendfile() into proxy; buffers are moved, not copied,
+ * unless the target is a ring, the proxy fans out or is weighted (moved
+ * buffers would not count against its share) */
+static ssize_t proxy_splice_write(struct pipe_inode_info *pipe,
+                                  struct file *out, loff_t *ppos,
+                                  size_t len, unsigned int flags)
+{
+	struct proxy_ctx *ctx = out->private_data;
+	struct proxy_targets *ts = proxy_targets_get(ctx);
+	struct proxy_target *t = proxy_pick(ctx, ts, false);
+	ssize_t ret;
+
+	if (t->ring || ctx->shard == PROXYFD_SHARD_TEE || ctx->weight)
+		ret = iter_file_splice_write(pipe, out, ppos, len, flags);
+	else
+		ret = pipe_framed_splice(ctx, pipe, t, len, flags);
+	proxy_targets_put(ts);
+	return ret;
+}
+
+/* Target woke its writers: pass it on to whoever polls the proxy, once;
+ * the next poll arms the entry again. */
+static int proxy_target_wake(struct wait_queue_entry *wait, unsigned int mode,
+                             int sync, void *key)
+{
+	struct proxy_ctx *ctx = wait->private;
+	__poll_t mask = key ? key_to_poll(key) : EPOLLOUT | EPOLLWRNORM;
+
+	if (!(mask & (EPOLLOUT | EPOLLWRNORM | EPOLLERR)))
+		return 0;
+	list_del_init(&wait->entry);
+	wake_up_interruptible_poll(&ctx->wait, mask);
+	return 0;
+}
+
+/* Forward the next wakeup of t to the proxy's pollers.  Only while
+ * polled: writers of the pipe don't walk an entry per proxy, nor see
+ * sleepers that aren't there. */
+static void proxy_target_arm(struct proxy_target *t)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&t->wq->lock, flags);
+	if (list_empty(&t->wait.entry))
+		__add_wait_queue(t->wq, &t->wait);
+	spin_unlock_irqrestore(&t->wq->lock, flags);
+}
+
+/* Pollers wait on the proxy rather than on the targets, which may be
+ * swapped (and released) while they do: retargeting wakes them, and a
+ * target's wakeup is forwarded by its entry. */
+static __poll_t proxy_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct proxy_ctx *ctx = filp->private_data;
+	struct proxy_targets *ts;
+	struct proxy_target *next;
+	/* fan-out, blocking: every pipe must have room */
+	bool all = ctx->shard == PROXYFD_SHARD_TEE &&
+	           !(ctx->mode & PROXYFD_MODE_TEE_DROP);
+	__poll_t mask = 0, out = EPOLLOUT | EPOLLWRNORM, m;
+	unsigned int i;
+
+	poll_wait(filp, &ctx->wait, wait);
+
+	ts = proxy_targets_get(ctx);
+	next = proxy_pick(ctx, ts, true);
+	/* writable if the next write goes through */
+	for (i = 0; i < ts->n; i++) {
+		struct proxy_target *t = &ts->t[i];
+
+		/* before looking: a wakeup in between isn't lost */
+		if (wait)
+			proxy_target_arm(t);
+		if (t->ring)
+			m = ring_framed_poll(ctx, t);
+		else
+			m = pipe_framed_poll(ctx, t);
+		if (t == next || all)
+			out &= m;
+		if (t == next || ctx->shard != PROXYFD_SHARD_TEE)
+			mask |= m & (EPOLLERR | EPOLLHUP);
+	}
+	proxy_targets_put(ts);
+	return mask | out;
+}
+
+static size_t proxy_lowat_max(struct proxy_ctx *ctx, struct proxy_targets *ts)
+{
+	size_t max = SIZE_MAX;
+	unsigned int i;
+
+	for (i = 0; i < ts->n; i++) {
+		struct proxy_target *t = &ts->t[i];
+
+		max = min(max, t->ring ? ring_framed_lowat_max(ctx, t) :
+		                         pipe_framed_lowat_max(ctx));
+	}
+	return max;
+}
+
+/* Open fd as the target t of ctx. */
+static int proxy_target_init(struct proxy_ctx *ctx, struct proxy_target *t,
+                             int fd)
+{
+	struct file *file;
+	int rc;
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+
+	if (!(file->f_mode & FMODE_WRITE)) {
+		rc = -EBADF;
+		goto error_fput;
+	}
+
+	t->file = file;
+	if (ring_file(file)) {
+		/* writes into rings are atomic anyway, nothing else applies */
+		if ((ctx->mode & ~PROXYFD_MODE_ATOMIC) ||
+		    ctx->shard == PROXYFD_SHARD_TEE || ctx->weight) {
+			rc = -EINVAL;
+			goto error_fput;
+		}
+		t->ring = file->private_data;
+		t->wq = ring_waitq(t->ring);
+	} else {
+		/* pipefifo_fops unexported */
+		if (strcmp(file->f_inode->i_sb->s_type->name, "pipefs")) {
+			rc = -EINVAL;
+			goto error_fput;
+		}
+
+		if (!pipe_framed_supported(file)) {
+			rc = -EXDEV;
+			goto error_fput;
+		}
+
+		rc = pipe_framed_attach(ctx, t);
+		if (rc)
+			goto error_fput;
+		t->wq = pipe_framed_waitq(t);
+	}
+
+	/* armed by proxy_poll */
+	init_waitqueue_func_entry(&t->wait, proxy_target_wake);
+	t->wait.private = ctx;
+	INIT_LIST_HEAD(&t->wait.entry);
+	return 0;
+
+error_fput:
+	fput(file);
+	return rc;
+}
+
+/* Targets: pipefd, or npipes of pipefds. */
+static struct proxy_targets *proxy_targets_open(struct proxy_ctx *ctx,
+                                                int pipefd, __u32 npipes,
+                                                __u64 pipefds)
+{
+	__s32 __user *ufds = u64_to_user_ptr(pipefds);
+	unsigned int n = npipes ? npipes : 1;
+	struct proxy_targets *ts;
+	int rc;
+
+	if (npipes > PROXYFD_PIPES_MAX)
+		return ERR_PTR(-EINVAL);
+
+	ts = kzalloc(struct_size(ts, t, n), GFP_KERNEL_ACCOUNT);
+	if (!ts)
+		return ERR_PTR(-ENOMEM);
+	refcount_set(&ts->ref, 1);
+
+	for (ts->n = 0; ts->n < n; ts->n++) {
+		__s32 fd = pipefd;
+
+		if (npipes && get_user(fd, ufds + ts->n)) {
+			rc = -EFAULT;
+			goto error_free;
+		}
+		rc = proxy_target_init(ctx, &ts->t[ts->n], fd);
+		if (rc)
+			goto error_free;
+	}
+	return ts;
+
+error_free:
+	proxy_targets_free(ts);
+	return ERR_PTR(rc);
+}
+
+/* PROXYFD_IOC_RETARGET: writes from now on go to the new targets, those
+ * in progress complete on the old ones, which are released after. */
+static long proxy_retarget(struct proxy_ctx *ctx,
+                           const struct proxyfd_retarget *rt)
+{
+	struct proxy_targets *ts, *old;
+
+	ts = proxy_targets_open(ctx, rt->pipefd, rt->npipes, rt->pipefds);
+	if (IS_ERR(ts))
+		return PTR_ERR(ts);
+
+	mutex_lock(&ctx->retarget_lock);
+	old = rcu_dereference_protected(ctx->targets,
+	                                lockdep_is_held(&ctx->retarget_lock));
+	rcu_assign_pointer(ctx->targets, ts);
+	mutex_unlock(&ctx->retarget_lock);
+
+	/* pollers may be waiting on the old targets only */
+	wake_up_interruptible_poll(&ctx->wait, EPOLLOUT | EPOLLWRNORM);
+
+	synchronize_rcu();
+	proxy_targets_put(old);
+	return 0;
+}
+
+/* Proxy's own ioctls, -ENOIOCTLCMD if cmd is not one of them */
+static long proxy_own_ioctl(struct proxy_ctx *ctx, unsigned int cmd,
+                            void __user *argp)
+{
+	struct proxyfd_retarget rt;
+	struct proxy_targets *ts;
+	struct proxyfd_wakeup w;
+	unsigned int i;
+	long rc = 0;
+	__u32 v;
+
+	switch (cmd) {
+	case PROXYFD_IOC_SET_LOWAT:
+	case PROXYFD_IOC_SET_WAKEUP:
+	case PROXYFD_IOC_FLUSH:
+		break;
+	case PROXYFD_IOC_RETARGET:
+		if (copy_from_user(&rt, argp, sizeof(rt)))
+			return -EFAULT;
+		return proxy_retarget(ctx, &rt);
+	default:
+		return -ENOIOCTLCMD;
+	}
 
-	return pipe_framed_write(ctx->pipe, from, ctx->cookie);
+	ts = proxy_targets_get(ctx);
+	switch (cmd) {
+	case PROXYFD_IOC_SET_LOWAT:
+		if (get_user(v, (__u32 __user *)argp)) {
+			rc = -EFAULT;
+			break;
+		}
+		if (v > proxy_lowat_max(ctx, ts)) {
+			rc = -EINVAL;
+			break;
+		}
+		WRITE_ONCE(ctx->lowat, v);
+		break;
+	case PROXYFD_IOC_SET_WAKEUP:
+		/* ring readers poll or take the eventfd */
+		for (i = 0; i < ts->n; i++)
+			if (ts->t[i].ring)
+				rc = -EINVAL;
+		if (!rc && copy_from_user(&w, argp, sizeof(w)))
+			rc = -EFAULT;
+		for (i = 0; !rc && i < ts->n; i++)
+			rc = pipe_framed_set_wakeup(&ts->t[i], &w);
+		break;
+	case PROXYFD_IOC_FLUSH:
+		for (i = 0; i < ts->n; i++)
+			if (!ts->t[i].ring)
+				pipe_framed_flush(&ts->t[i]);
+		break;
+	}
+	proxy_targets_put(ts);
+	return rc;
 }
 
 static long proxy_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct proxy_ctx *ctx = filp->private_data;
+	struct proxy_targets *ts;
+	struct file *pipe;
+	long rc;
 
 	if (cmd == TCGETS)
 		return 0;
 
-	if (ctx->pipe->f_op->unlocked_ioctl) {
-		return ctx->pipe->f_op->unlocked_ioctl(ctx->pipe, cmd, arg);
+	rc = proxy_own_ioctl(ctx, cmd, (void __user *)arg);
+	if (rc != -ENOIOCTLCMD)
+		return rc;
+
+	/* sharded: the first pipe speaks for all */
+	ts = proxy_targets_get(ctx);
+	pipe = ts->t[0].file;
+	rc = -ENOTTY;
+	if (pipe->f_op->unlocked_ioctl) {
+		rc = pipe->f_op->unlocked_ioctl(pipe, cmd, arg);
 	}
+	proxy_targets_put(ts);
 
-	return -ENOTTY;
+	return rc;
 }
 
 static long proxy_compat_ioctl(struct file *filp,
                                unsigned int cmd, unsigned long arg)
 {
 	struct proxy_ctx *ctx = filp->private_data;
+	struct proxy_targets *ts;
+	struct file *pipe;
+	long rc;
 
 	if (cmd == TCGETS)
 		return 0;
 
-	if (ctx->pipe->f_op->compat_ioctl) {
-		return ctx->pipe->f_op->compat_ioctl(ctx->pipe, cmd, arg);
+	rc = proxy_own_ioctl(ctx, cmd, compat_ptr(arg));
+	if (rc != -ENOIOCTLCMD)
+		return rc;
+
+	ts = proxy_targets_get(ctx);
+	pipe = ts->t[0].file;
+	rc = -ENOTTY;
+	if (pipe->f_op->compat_ioctl) {
+		rc = pipe->f_op->compat_ioctl(pipe, cmd, arg);
 	}
+	proxy_targets_put(ts);
 
-	return -ENOTTY;
+	return rc;
 }
 
 static int proxy_close(struct inode *inode, struct file *filp)
 {
 	struct proxy_ctx *ctx = filp->private_data;
 
-	fput(ctx->pipe);
+	/* nobody else left to look at the targets */
+	proxy_targets_put(rcu_dereference_protected(ctx->targets, true));
+	kmem_cache_free(proxy_ctx_cachep, ctx);
+	atomic_dec(&proxy_count);
 
 	return 0;
 }
 
+/* /proc/<pid>/fdinfo/<fd> */
+static void proxy_show_fdinfo(struct seq_file *m, struct file *filp)
+{
+	struct proxy_ctx *ctx = filp->private_data;
+	struct proxy_targets *ts = proxy_targets_get(ctx);
+	int i;
+
+	seq_printf(m, "hdr:\t%u\n", ctx->hdr);
+	if (ctx->hdr == PROXYFD_HDR_V1)
+		seq_printf(m, "stream:\t%llu\n", (unsigned long long)ctx->stream);
+	else
+		seq_printf(m, "cookie:\t%08x\n", be32_to_cpu(ctx->cookie));
+	if (ts->n > 1)
+		seq_printf(m, "shard:\t%u\n", ctx->shard);
+	/* a block per target */
+	for (i = 0; i < ts->n; i++) {
+		struct proxy_target *t = &ts->t[i];
+
+		if (t->ring)
+			seq_printf(m, "target:\tring\n");
+		seq_printf(m, "pipe_ino:\t%lu\n", file_inode(t->file)->i_ino);
+		if (ctx->mode & PROXYFD_MODE_TS)
+			seq_printf(m, "pipe_seq:\t%llu\n",
+			           (unsigned long long)pipe_framed_seq(t));
+	}
+	proxy_targets_put(ts);
+	seq_printf(m, "mode:\t%x\n", ctx->mode);
+	if (ctx->mode & PROXYFD_MODE_ATOMIC)
+		seq_printf(m, "max_atomic:\t%u\n", ctx->max_atomic);
+	if (ctx->weight)
+		seq_printf(m, "weight:\t%u\n", ctx->weight);
+	for (i = 0; i < PROXY_STAT_NR; i++)
+		seq_printf(m, "%s:\t%lld\n", proxy_stat_names[i],
+		           (long long)atomic64_read(&ctx->stats.v[i]));
+}
+
 static struct file_operations proxy_fops = {
 	.owner = THIS_MODULE,
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,12,0)
 	.llseek	        = no_llseek,
+#endif
 	.write_iter     = proxy_write_iter,
+	.splice_write   = proxy_splice_write,
+	.poll           = proxy_poll,
 	.unlocked_ioctl = proxy_ioctl,
 	.compat_ioctl   = proxy_compat_ioctl,
 	.release        = proxy_close,
+	.show_fdinfo    = proxy_show_fdinfo,
 };
 
 /* control device */
@@ -157,31 +592,151 @@ err_module:
 }
 #endif
 
-static int proxy_getfd(void *ctx, int flags)
+/* Install proxy file at the lowest free fd; replace_fd is unexported,
+ * moving it elsewhere is up to the caller.  The file reference is
+ * consumed. */
+static int proxy_installfd(struct file *file, int flags)
 {
 	int fd;
-	struct file *file;
 
 	fd = get_unused_fd_flags(flags);
-	if (fd < 0)
+	if (fd < 0) {
+		fput(file);
 		return fd;
+	}
+	fd_install(fd, file);
+	return fd;
+}
+
+/* Proxy file, not installed yet. */
+static struct file *proxy_create(const struct proxyfd_req *r)
+{
+	int rc, flags;
+	unsigned int max;
+	struct proxy_targets *ts;
+	struct proxy_ctx *ctx;
+	struct file *file;
+
+	if (r->flags & ~(__u32)(O_CLOEXEC | O_NONBLOCK) || r->pad)
+		return ERR_PTR(-EINVAL);
+
+	if (r->mode & ~PROXYFD_MODE_MASK)
+		return ERR_PTR(-EINVAL);
+
+	if (r->max_atomic && !(r->mode & PROXYFD_MODE_ATOMIC))
+		return ERR_PTR(-EINVAL);
+
+	if ((r->mode & PROXYFD_MODE_PERCPU) &&
+	    (r->mode & (PROXYFD_MODE_IOVEC | PROXYFD_MODE_ATOMIC |
+	                PROXYFD_MODE_TS)))
+		return ERR_PTR(-EINVAL);
+
+	switch (r->hdr) {
+	case PROXYFD_HDR_V0:
+		if (r->stream || (r->mode & PROXYFD_MODE_TS))
+			return ERR_PTR(-EINVAL);
+		break;
+	case PROXYFD_HDR_V1:
+		if (r->cookie)
+			return ERR_PTR(-EINVAL);
+		break;
+	default:
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (r->shard > PROXYFD_SHARD_TEE || (r->shard && !r->npipes))
+		return ERR_PTR(-EINVAL);
+
+	/* fan-out writes a single record at a time, directly, a frame per
+	 * set of pages */
+	if ((r->mode & PROXYFD_MODE_TEE_DROP) && r->shard != PROXYFD_SHARD_TEE)
+		return ERR_PTR(-EINVAL);
+	if (r->shard == PROXYFD_SHARD_TEE &&
+	    (r->mode & (PROXYFD_MODE_IOVEC | PROXYFD_MODE_PERCPU |
+	                PROXYFD_MODE_PACKED)))
+		return ERR_PTR(-EINVAL);
+
+	if (r->weight > PROXYFD_WEIGHT_MAX || r->reserved)
+		return ERR_PTR(-EINVAL);
+	if ((r->mode & PROXYFD_MODE_FAIR_DROP) && !r->weight)
+		return ERR_PTR(-EINVAL);
+	/* stages and fan-out pages are shared, no owner to charge */
+	if (r->weight && ((r->mode & PROXYFD_MODE_PERCPU) ||
+	                  r->shard == PROXYFD_SHARD_TEE))
+		return ERR_PTR(-EINVAL);
+
+	/* stages and fan-out copies come in pages; whether a record fits
+	 * can't be told before the large pages are there */
+	if ((r->mode & PROXYFD_MODE_LARGEBUF) &&
+	    ((r->mode & (PROXYFD_MODE_PERCPU | PROXYFD_MODE_ATOMIC)) ||
+	     r->shard == PROXYFD_SHARD_TEE))
+		return ERR_PTR(-EINVAL);
+
+	/* pinned pages go in as they come, uncharged */
+	if ((r->mode & PROXYFD_MODE_ZEROCOPY) &&
+	    ((r->mode & (PROXYFD_MODE_IOVEC | PROXYFD_MODE_ATOMIC)) ||
+	     r->shard == PROXYFD_SHARD_TEE || r->weight))
+		return ERR_PTR(-EINVAL);
+
+	/* the slot is given back on close */
+	max = READ_ONCE(max_proxies);
+	if (atomic_inc_return(&proxy_count) > max && max) {
+		rc = -ENFILE;
+		goto error_count;
+	}
+
+	ctx = kmem_cache_zalloc(proxy_ctx_cachep, GFP_KERNEL);
+	if (!ctx) {
+		rc = -ENOMEM;
+		goto error_count;
+	}
 
+	ctx->shard = r->shard;
+	ctx->cookie = r->cookie;
+	ctx->mode = r->mode;
+	ctx->max_atomic = r->max_atomic;
+	ctx->hdr = r->hdr;
+	ctx->stream = r->stream;
+	ctx->weight = r->weight;
+	mutex_init(&ctx->retarget_lock);
+	init_waitqueue_head(&ctx->wait);
+
+	ts = proxy_targets_open(ctx, r->pipefd, r->npipes, r->pipefds);
+	if (IS_ERR(ts)) {
+		rc = PTR_ERR(ts);
+		goto error_free_ctx;
+	}
+	RCU_INIT_POINTER(ctx->targets, ts);
+
+	flags = O_WRONLY | (r->flags & (O_CLOEXEC | O_NONBLOCK));
 	file = proxy_getfile(ctx, flags);
 	if (IS_ERR(file)) {
-		put_unused_fd(fd);
-		return PTR_ERR(file);
+		rc = PTR_ERR(file);
+		proxy_targets_free(ts);
+		goto error_free_ctx;
 	}
-	fd_install(fd, file);
-	return fd;
+
+#ifdef FMODE_NOWAIT
+	/* io_uring may issue IOCB_NOWAIT writes inline */
+	file->f_mode |= FMODE_NOWAIT;
+#endif
+
+	/* ctx and its targets are owned by file from now on */
+	return file;
+
+error_free_ctx:
+	kmem_cache_free(proxy_ctx_cachep, ctx);
+error_count:
+	atomic_dec(&proxy_count);
+	return ERR_PTR(rc);
 }
 
 static ssize_t dev_write(struct file *filp, const char __user *buf,
                          size_t count, loff_t *ppos)
 {
-	ssize_t rc;
-	struct file *pipe;
-	struct proxy_ctx *ctx;
 	struct proxy_req r;
+	struct proxyfd_req req = {};
+	struct file *file;
 
 	if (count != sizeof(r))
 		return -EINVAL;
@@ -189,47 +744,164 @@ static ssize_t dev_write(struct file *filp, const char __user *buf,
 	if (copy_from_user(&r, buf, sizeof(r)))
 		return -EFAULT;
 
-	if (r.flags & ~(__u32)(O_CLOEXEC | O_NONBLOCK))
+	req.flags = r.flags;
+	req.cookie = r.cookie;
+	req.pipefd = r.pipefd;
+
+	file = proxy_create(&req);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	return proxy_installfd(file, req.flags);
+}
+
+/* PROXYFD_IOC_CREATE: every entry is processed, errors are reported
+ * per entry.  Returns the number of proxies created.  Fds are reserved
+ * as the proxies are made and installed once all results are out: on a
+ * fault, the caller is left with none it can't know of. */
+static long dev_create_batch(struct proxyfd_batch __user *ubatch)
+{
+	struct proxyfd_batch b;
+	struct {
+		struct file *file;
+		int          fd;   /* or -errno */
+	} *e;
+	char __user *ureq;
+	long created = 0;
+	__u32 i, n;
+
+	/* the smallest entry the caller may pass has room for the result */
+	BUILD_BUG_ON(PROXYFD_REQ_SIZE_VER0 <
+	             offsetofend(struct proxyfd_req, result));
+
+	if (copy_from_user(&b, ubatch, sizeof(b)))
+		return -EFAULT;
+
+	if (b.size < PROXYFD_REQ_SIZE_VER0 || b.count > PROXYFD_BATCH_MAX)
 		return -EINVAL;
 
-	pipe = fget(r.pipefd);
-	if (!pipe)
-		return -EBADF;
+	/* built against a newer interface */
+	if (b.size > sizeof(struct proxyfd_req))
+		return -E2BIG;
 
-	if (!(pipe->f_mode & FMODE_WRITE)) {
-		rc = -EBADF;
-		goto error_fput_pipe;
+	e = kvmalloc_array(b.count, sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return -ENOMEM;
+
+	ureq = u64_to_user_ptr(b.reqs);
+	for (n = 0; n < b.count; n++, ureq += b.size) {
+		struct proxyfd_req r = {};
+
+		if (copy_from_user(&r, ureq, b.size))
+			goto fault;
+
+		e[n].file = proxy_create(&r);
+		if (IS_ERR(e[n].file)) {
+			e[n].fd = PTR_ERR(e[n].file);
+			e[n].file = NULL;
+			continue;
+		}
+		e[n].fd = get_unused_fd_flags(r.flags);
+		if (e[n].fd < 0) {
+			fput(e[n].file);
+			e[n].file = NULL;
+		}
 	}
 
-	/* pipefifo_fops unexported */
-	if (strcmp(pipe->f_inode->i_sb->s_type->name, "pipefs")) {
-		rc = -EINVAL;
-		goto error_fput_pipe;
+	ureq = u64_to_user_ptr(b.reqs);
+	for (i = 0; i < b.count; i++, ureq += b.size) {
+		__s32 __user *uresult = (__s32 __user *)(ureq +
+		                        offsetof(struct proxyfd_req, result));
+
+		if (put_user(e[i].fd, uresult))
+			goto fault;
 	}
 
-	ctx = kmalloc(sizeof(*ctx), GFP_KERNEL);
-	if (!ctx) {
-		rc = -ENOMEM;
-		goto error_fput_pipe;
+	for (i = 0; i < b.count; i++) {
+		if (!e[i].file)
+			continue;
+		fd_install(e[i].fd, e[i].file);
+		created++;
+	}
+	kvfree(e);
+	return created;
+
+fault:
+	for (i = 0; i < n; i++) {
+		if (!e[i].file)
+			continue;
+		put_unused_fd(e[i].fd);
+		fput(e[i].file);
 	}
+	kvfree(e);
+	return -EFAULT;
+}
 
-	ctx->pipe = pipe;
-	ctx->cookie = r.cookie;
+static long dev_create_ring(struct proxyfd_ring_req __user *ureq)
+{
+	struct proxyfd_ring_req r;
 
-	rc = proxy_getfd(ctx,
-	                 O_WRONLY | (r.flags & (O_CLOEXEC | O_NONBLOCK)));
-	if (rc < 0) {
-		kfree(ctx);
-		goto error_fput_pipe;
-	}
+	if (copy_from_user(&r, ureq, sizeof(r)))
+		return -EFAULT;
 
-	return rc;
+	return ring_create(&r);
+}
+
+static long dev_recv(struct proxyfd_recv __user *ureq)
+{
+	struct proxyfd_recv r;
+	struct file *file;
+	long rc;
 
-error_fput_pipe:
-	fput(pipe);
+	if (copy_from_user(&r, ureq, sizeof(r)))
+		return -EFAULT;
+
+	if ((r.flags & ~PROXYFD_RECV_NONBLOCK) || r.pad ||
+	    r.hdr > PROXYFD_HDR_V1 || !r.nframes)
+		return -EINVAL;
+
+	file = fget(r.pipefd);
+	if (!file)
+		return -EBADF;
+
+	rc = -EBADF;
+	if (!(file->f_mode & FMODE_READ))
+		goto out;
+
+	rc = -EINVAL;
+	/* pipefifo_fops unexported */
+	if (strcmp(file->f_inode->i_sb->s_type->name, "pipefs") ||
+	    !pipe_framed_supported(file))
+		goto out;
+
+	rc = pipe_framed_recv(file, &r);
+	if (rc >= 0 && (put_user(r.nframes, &ureq->nframes) ||
+	                put_user(r.buflen, &ureq->buflen)))
+		rc = -EFAULT;
+out:
+	fput(file);
 	return rc;
 }
 
+static long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case PROXYFD_IOC_CREATE:
+		return dev_create_batch((struct proxyfd_batch __user *)arg);
+	case PROXYFD_IOC_RING_CREATE:
+		return dev_create_ring((struct proxyfd_ring_req __user *)arg);
+	case PROXYFD_IOC_RECV:
+		return dev_recv((struct proxyfd_recv __user *)arg);
+	}
+
+	return -ENOTTY;
+}
+
+static long dev_compat_ioctl(struct file *filp, unsigned int cmd,
+                             unsigned long arg)
+{
+	return dev_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+
 static int dev_open(struct inode *inode, struct file *filp)
 {
 	if (iminor(inode))
@@ -241,10 +913,35 @@ static struct file_operations dev_fops =
 {
 	.owner = THIS_MODULE,
 
-	.open  = dev_open,
-	.write = dev_write,
+	.open           = dev_open,
+	.write          = dev_write,
+	.unlocked_ioctl = dev_ioctl,
+	.compat_ioctl   = dev_compat_ioctl,
 };
 
+/* module-wide stats, debugfs */
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	u64 total[PROXY_STAT_NR] = {};
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct proxy_global_stats *s = per_cpu_ptr(&proxy_global_stats,
+		                                           cpu);
+		for (i = 0; i < PROXY_STAT_NR; i++)
+			total[i] += s->v[i];
+	}
+
+	seq_printf(m, "proxies:\t%d\n", atomic_read(&proxy_count));
+	seq_printf(m, "max_proxies:\t%u\n", READ_ONCE(max_proxies));
+	for (i = 0; i < PROXY_STAT_NR; i++)
+		seq_printf(m, "%s:\t%llu\n", proxy_stat_names[i],
+		           (unsigned long long)total[i]);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
 /* pseudo filesystem */
 
 static char *proxy_inodefs_dname(struct dentry *dentry, char *buffer, int buflen)
@@ -290,7 +987,11 @@ static struct file_system_type proxy_inode_fs_type = {
 
 /* module lifetime */
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
+static char *dev_node(const struct device *dev, umode_t *mode)
+#else
 static char *dev_node(struct device *dev, umode_t *mode)
+#endif
 {
 	if (mode)
 		*mode = 0222;
@@ -303,9 +1004,22 @@ static int __init mod_init(void)
 	int rc;
 	static struct device *device;
 
+	/* charged to the creator's memcg, as the files are */
+	proxy_ctx_cachep = KMEM_CACHE(proxy_ctx, SLAB_ACCOUNT);
+	if (!proxy_ctx_cachep)
+		return -ENOMEM;
+
+	proxy_wq = alloc_workqueue("proxyfd", 0, 0);
+	if (!proxy_wq) {
+		rc = -ENOMEM;
+		goto error_cache;
+	}
+
 	proxy_inode_mnt = kern_mount(&proxy_inode_fs_type);
-	if (IS_ERR(proxy_inode_mnt))
-		return PTR_ERR(proxy_inode_mnt);
+	if (IS_ERR(proxy_inode_mnt)) {
+		rc = PTR_ERR(proxy_inode_mnt);
+		goto error_wq;
+	}
 
 	proxy_inode_inode = alloc_anon_inode(proxy_inode_mnt->mnt_sb);
 	if (IS_ERR(proxy_inode_inode)) {
@@ -321,7 +1035,11 @@ static int __init mod_init(void)
 		goto error_unmount;
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+	class = class_create(CLASS_NAME);
+#else
 	class = class_create(THIS_MODULE, CLASS_NAME);
+#endif
 	if (IS_ERR(class)) {
 		rc = PTR_ERR(class);
 		goto error_unregister_chrdev;
@@ -335,6 +1053,10 @@ static int __init mod_init(void)
 		goto error_class_destroy;
 	}
 
+	/* debugfs is optional, errors are ignored */
+	debugfs_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+	debugfs_create_file("stats", 0444, debugfs_dir, NULL, &stats_fops);
+
 	return 0;
 
 error_class_destroy:
@@ -345,17 +1067,24 @@ error_iput:
 	iput(proxy_inode_inode);
 error_unmount:
 	kern_unmount(proxy_inode_mnt);
+error_wq:
+	destroy_workqueue(proxy_wq);
+error_cache:
+	kmem_cache_destroy(proxy_ctx_cachep);
 	return rc;
 }
 
 static void __exit mod_exit(void)
 {
+	debugfs_remove_recursive(debugfs_dir);
 	device_destroy(class, MKDEV(major, 0));
 	class_unregister(class);
 	class_destroy(class);
 	unregister_chrdev(major, DEVICE_NAME);
 	iput(proxy_inode_inode);
 	kern_unmount(proxy_inode_mnt);
+	kmem_cache_destroy(proxy_ctx_cachep);
+	destroy_workqueue(proxy_wq);
 }
 
 module_init(mod_init);
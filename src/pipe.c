@@ -1,10 +1,20 @@
 /* proxyfd kernel module
  *
- * pipe_framed_write - inserts a header before each chunk submitted;
- *                     header is a BE __u32 chunk len, OR-d with a cookie.
+ * pipe_framed_write  - inserts a header before each chunk submitted;
+ *                      header is a BE __u32 chunk len, OR-d with a cookie,
+ *                      or struct proxyfd_hdr_v1 (see proxyfd.h).
  *
- * Based on pipe_write from linux/fs/pipe.c.  As crazy as it sounds, we
- * have a lot of code copied verbatim.  Should work, though.
+ * pipe_framed_splice - same framing for buffers spliced from another
+ *                      pipe; buffers are moved, not copied.
+ *
+ * Based on pipe_write from linux/fs/pipe.c and splice_pipe_to_pipe from
+ * linux/fs/splice.c.  As crazy as it sounds, we have a lot of code copied
+ * verbatim.  Should work, though.
+ *
+ * Pipe internals changed a lot over time: 5.5 replaced nrbufs/curbuf
+ * with a head/tail ring, 5.6 split the waitqueue into rd_wait/wr_wait,
+ * 5.8 reworked pipe_buf_operations.  Framing code talks to the pipe via
+ * ring_* helpers only, these hide the differences.
  */
 #include <linux/module.h>
 #include <linux/kernel.h>
@@ -13,31 +23,590 @@
 #include <linux/fs.h>
 #include <linux/uio.h>
 #include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 #include <linux/sched/signal.h>
 #include <linux/poll.h>
 #include <linux/mm.h>
 #include <linux/highmem.h>
 #include <linux/eventpoll.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/version.h>
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/refcount.h>
+#include <linux/workqueue.h>
+
+#include "proxyfd.h"
+#include "proxy.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+#define PIPE_RING
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+#define PIPE_SPLIT_WAIT
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+#define PIPE_TRY_STEAL
+#endif
+
+/* Buffers in use. */
+static inline unsigned int ring_nrbufs(const struct pipe_inode_info *pipe)
+{
+#ifdef PIPE_RING
+	return pipe_occupancy(pipe->head, pipe->tail);
+#else
+	return pipe->nrbufs;
+#endif
+}
+
+/* Buffers allowed. */
+static inline unsigned int ring_maxbufs(const struct pipe_inode_info *pipe)
+{
+#ifdef PIPE_RING
+	return pipe->max_usage;
+#else
+	return pipe->buffers;
+#endif
+}
+
+static inline bool ring_full(const struct pipe_inode_info *pipe)
+{
+	return ring_nrbufs(pipe) >= ring_maxbufs(pipe);
+}
+
+/* i-th buffer in use, counting from the oldest one; i == ring_nrbufs()
+ * yields the slot to fill next. */
+static inline struct pipe_buffer *ring_buf(struct pipe_inode_info *pipe,
+                                           unsigned int i)
+{
+#ifdef PIPE_RING
+	return &pipe->bufs[(pipe->tail + i) & (pipe->ring_size - 1)];
+#else
+	return pipe->bufs + ((pipe->curbuf + i) & (pipe->buffers - 1));
+#endif
+}
+
+static inline struct pipe_buffer *ring_head(struct pipe_inode_info *pipe)
+{
+	return ring_buf(pipe, ring_nrbufs(pipe));
+}
+
+static inline struct pipe_buffer *ring_last(struct pipe_inode_info *pipe)
+{
+	unsigned int n = ring_nrbufs(pipe);
+
+	return n ? ring_buf(pipe, n - 1) : NULL;
+}
+
+/* Make ring_head() buffer visible to readers. */
+static inline void ring_push(struct pipe_inode_info *pipe)
+{
+#ifdef PIPE_RING
+	pipe->head++;
+#else
+	pipe->nrbufs++;
+#endif
+}
+
+/* Take back the newest buffer before readers see it (pipe locked). */
+static inline void ring_unpush(struct pipe_inode_info *pipe)
+{
+#ifdef PIPE_RING
+	pipe->head--;
+#else
+	pipe->nrbufs--;
+#endif
+}
+
+/* Drop the oldest buffer, it must be released already. */
+static inline void ring_pop(struct pipe_inode_info *pipe)
+{
+#ifdef PIPE_RING
+	pipe->tail++;
+#else
+	pipe->curbuf = (pipe->curbuf + 1) & (pipe->buffers - 1);
+	pipe->nrbufs--;
+#endif
+}
+
+/* Readers and writers have separate waitqueues in newer kernels;
+ * writers wake readers only and vice versa. */
+static void ring_wake_readers(struct pipe_inode_info *pipe)
+{
+#ifdef PIPE_SPLIT_WAIT
+	if (wq_has_sleeper(&pipe->rd_wait))
+		wake_up_interruptible_sync_poll(&pipe->rd_wait,
+		                                EPOLLIN | EPOLLRDNORM);
+#else
+	if (wq_has_sleeper(&pipe->wait))
+		wake_up_interruptible_sync_poll(&pipe->wait,
+		                                EPOLLIN | EPOLLRDNORM);
+#endif
+	kill_fasync(&pipe->fasync_readers, SIGIO, POLL_IN);
+}
+
+static void ring_wake_writers(struct pipe_inode_info *pipe)
+{
+#ifdef PIPE_SPLIT_WAIT
+	if (wq_has_sleeper(&pipe->wr_wait))
+		wake_up_interruptible_sync_poll(&pipe->wr_wait,
+		                                EPOLLOUT | EPOLLWRNORM);
+#else
+	if (wq_has_sleeper(&pipe->wait))
+		wake_up_interruptible_sync_poll(&pipe->wait,
+		                                EPOLLOUT | EPOLLWRNORM);
+#endif
+	kill_fasync(&pipe->fasync_writers, SIGIO, POLL_OUT);
+}
+
+#ifdef PIPE_SPLIT_WAIT
+/* Taken verbatim from linux/fs/pipe.c. */
+static inline bool pipe_readable(const struct pipe_inode_info *pipe)
+{
+	unsigned int head = READ_ONCE(pipe->head);
+	unsigned int tail = READ_ONCE(pipe->tail);
+	unsigned int writers = READ_ONCE(pipe->writers);
+
+	return !pipe_empty(head, tail) || !writers;
+}
 
 /* Taken verbatim from linux/fs/pipe.c. */
+static inline bool pipe_writable(const struct pipe_inode_info *pipe)
+{
+	unsigned int head = READ_ONCE(pipe->head);
+	unsigned int tail = READ_ONCE(pipe->tail);
+	unsigned int max_usage = READ_ONCE(pipe->max_usage);
+
+	return !pipe_full(head, tail, max_usage) ||
+		!READ_ONCE(pipe->readers);
+}
+#endif
+
+#ifdef PIPE_SPLIT_WAIT
+static inline bool ring_has_room(const struct pipe_inode_info *pipe,
+                                 unsigned int nbufs)
+{
+	unsigned int head = READ_ONCE(pipe->head);
+	unsigned int tail = READ_ONCE(pipe->tail);
+	unsigned int max_usage = READ_ONCE(pipe->max_usage);
+
+	return pipe_occupancy(head, tail) + nbufs <= max_usage ||
+		!READ_ONCE(pipe->readers);
+}
+
+/* Readers wake writers only when the pipe was full.  Waiting for more
+ * than a single buffer, the release of the buffer that makes the room
+ * wakes us if it's one of ours (ring_tag_room); otherwise we may miss
+ * the moment, hence recheck periodically. */
+#define ROOM_RECHECK (HZ / 100 ? : 1)
+#endif
+
+/* buf->private of framed buffers: the share they are charged to, or
+ * with BUF_POOL the page pool of their pipe, and BUF_WAKE if a writer
+ * waits for the buffer to be released. */
+#define BUF_WAKE 1UL
+#define BUF_POOL 2UL
+#define BUF_TAGS (BUF_WAKE | BUF_POOL)
+
+static const struct pipe_buf_operations anon_pipe_buf_ops;
+static const struct pipe_buf_operations user_page_pipe_buf_ops;
+
+#ifdef PIPE_SPLIT_WAIT
+/* Waiting for nbufs free buffers: have the buffer whose release makes
+ * the room wake writers.  Returns false if that buffer is not ours,
+ * e.g. from a plain write(), pipe locked. */
+static bool ring_tag_room(struct pipe_inode_info *pipe, unsigned int nbufs)
+{
+	unsigned int n = ring_nrbufs(pipe), max = ring_maxbufs(pipe);
+	struct pipe_buffer *buf;
+
+	if (n + nbufs <= max)
+		return true;
+	if (nbufs > max)
+		return false;
+	buf = ring_buf(pipe, n + nbufs - max - 1);
+	if (buf->ops != &anon_pipe_buf_ops &&
+	    buf->ops != &user_page_pipe_buf_ops)
+		return false;
+	buf->private |= BUF_WAKE;
+	return true;
+}
+#endif
+
+/* Sleep until nbufs buffers are free, or at least until something
+ * changes; pipe lock is dropped meanwhile.  Exclusive waiter must pass
+ * the wakeup on (see pipe_write), true is returned in this case. */
+static bool ring_wait_room(struct pipe_inode_info *pipe, unsigned int nbufs,
+                           bool exclusive)
+{
+#ifdef PIPE_SPLIT_WAIT
+	bool tagged = nbufs > 1 && ring_tag_room(pipe, nbufs);
+
+	pipe_unlock(pipe);
+	if (tagged) {
+		wait_event_interruptible(pipe->wr_wait,
+		                         ring_has_room(pipe, nbufs));
+		exclusive = false;
+	} else if (nbufs > 1) {
+		wait_event_interruptible_timeout(pipe->wr_wait,
+		                                 ring_has_room(pipe, nbufs),
+		                                 ROOM_RECHECK);
+		exclusive = false;
+	} else if (exclusive) {
+		wait_event_interruptible_exclusive(pipe->wr_wait,
+		                                   pipe_writable(pipe));
+	} else {
+		wait_event_interruptible(pipe->wr_wait, pipe_writable(pipe));
+	}
+	pipe_lock(pipe);
+	return exclusive;
+#else
+#ifndef PIPE_RING
+	pipe->waiting_writers++;
+#endif
+	pipe_wait(pipe);
+#ifndef PIPE_RING
+	pipe->waiting_writers--;
+#endif
+	return false;
+#endif
+}
+
+/* Sleep until the pipe is not empty; pipe lock is dropped meanwhile. */
+static void ring_wait_readable(struct pipe_inode_info *pipe)
+{
+#ifdef PIPE_SPLIT_WAIT
+	pipe_unlock(pipe);
+	wait_event_interruptible(pipe->rd_wait, pipe_readable(pipe));
+	pipe_lock(pipe);
+#else
+	pipe_wait(pipe);
+#endif
+}
+
+/* Recycled pages, per pipe.  Framed writes take pages from here before
+ * going to the page allocator, released buffers put their pages back
+ * once the pipe's own spare (tmp_page) is there.  Pages stay charged to
+ * the memory cgroup they were first allocated in, only as long as
+ * proxies write into the pipe.  The pipe's entry and its buffers hold
+ * references, so that releases find the pool without a lookup.  Pipe
+ * buffers are released in process context only. */
+#define POOL_PAGES 16
+
+struct framed_pool {
+	refcount_t   ref;
+	spinlock_t   lock;
+	bool         closed;  /* last proxy gone, pages go back */
+	unsigned int n;
+	struct page *pages[POOL_PAGES];
+};
+
+static void pool_put(struct framed_pool *pool)
+{
+	if (!refcount_dec_and_test(&pool->ref))
+		return;
+	while (pool->n)
+		put_page(pool->pages[--pool->n]);
+	kfree(pool);
+}
+
+/* Drop a reference, keeping the page in pool, if any, if it was the
+ * last one. */
+static void pool_put_page(struct framed_pool *pool, struct page *page)
+{
+	if (pool && page_count(page) == 1 && !PageCompound(page)) {
+		spin_lock(&pool->lock);
+		if (!pool->closed && pool->n < POOL_PAGES) {
+			pool->pages[pool->n++] = page;
+			page = NULL;
+		}
+		spin_unlock(&pool->lock);
+	}
+	if (page)
+		put_page(page);
+}
+
+/* Buffers a weighted proxy holds in the pipe.  Buffers it adds point
+ * here (buf->private) and hold a reference; released in the pipe, they
+ * are uncharged.  Buffers spliced out to another pipe are not, hence
+ * the count may be too high: it's capped at the buffers in the pipe. */
+struct framed_share {
+	refcount_t              ref;
+	atomic_t                bufs;
+	struct pipe_inode_info *pipe;
+	struct framed_pool     *pool;  /* of the pipe, for the buffers */
+	unsigned int            weight;
+	unsigned int            wake_below;  /* writers wait, 0: none */
+};
+
+static void share_put(struct framed_share *share)
+{
+	if (!refcount_dec_and_test(&share->ref))
+		return;
+	pool_put(share->pool);
+	kfree(share);
+}
+
+/* Buffers the share holds, pipe locked. */
+static unsigned int share_used(struct framed_share *share)
+{
+	unsigned int nrbufs = ring_nrbufs(share->pipe);
+
+	/* all released, whatever the count says */
+	if (!nrbufs)
+		atomic_set(&share->bufs, 0);
+	return min_t(unsigned int, atomic_read(&share->bufs), nrbufs);
+}
+
+static inline struct framed_share *buf_share(const struct pipe_buffer *buf)
+{
+	if (buf->private & BUF_POOL)
+		return NULL;
+	return (struct framed_share *)(buf->private & ~BUF_TAGS);
+}
+
+static inline struct framed_pool *buf_pool(const struct pipe_buffer *buf)
+{
+	struct framed_share *share;
+
+	if (buf->private & BUF_POOL)
+		return (struct framed_pool *)(buf->private & ~BUF_TAGS);
+	share = buf_share(buf);
+	return share ? share->pool : NULL;
+}
+
+/* Does the share hold fewer than limit buffers?  Lockless. */
+static bool share_below(struct framed_share *share, unsigned int limit)
+{
+	return min_t(unsigned int, atomic_read(&share->bufs),
+	             ring_nrbufs(share->pipe)) < limit;
+}
+
+/* Have the release that gets the share below limit wake writers. */
+static void share_arm(struct framed_share *share, unsigned int limit)
+{
+	if (limit > READ_ONCE(share->wake_below))
+		WRITE_ONCE(share->wake_below, limit);
+}
+
+/* A buffer of the share is released in its pipe, pipe locked. */
+static void share_uncharge(struct framed_share *share,
+                           struct pipe_inode_info *pipe)
+{
+	/* the buffer is still in the pipe, hence the - 1 */
+	int used = min_t(int, atomic_dec_return(&share->bufs),
+	                 (int)ring_nrbufs(pipe) - 1);
+	unsigned int limit = READ_ONCE(share->wake_below);
+
+	if (limit && used < (int)limit) {
+		WRITE_ONCE(share->wake_below, 0);
+		ring_wake_writers(pipe);
+	}
+}
+
+/* buf was just added, by the share's owner if share, to the pipe of
+ * pool; pipe locked. */
+static void buf_charge(struct framed_pool *pool, struct framed_share *share,
+                       struct pipe_buffer *buf)
+{
+	if (!share) {
+		refcount_inc(&pool->ref);
+		buf->private = (unsigned long)pool | BUF_POOL;
+		return;
+	}
+	refcount_inc(&share->ref);
+	atomic_inc(&share->bufs);
+	buf->private = (unsigned long)share;
+}
+
+/* Sleep until the share holds fewer than limit buffers, or at least
+ * until something changes; pipe lock is dropped meanwhile.  Buffers
+ * spliced out wake us from the splice, those released here from
+ * share_uncharge. */
+static void share_wait(struct framed_share *share, unsigned int limit)
+{
+	struct pipe_inode_info *pipe = share->pipe;
+
+#ifdef PIPE_SPLIT_WAIT
+	share_arm(share, limit);
+	pipe_unlock(pipe);
+	wait_event_interruptible(pipe->wr_wait,
+	                         share_below(share, limit) ||
+	                         !READ_ONCE(pipe->readers));
+	pipe_lock(pipe);
+#else
+	/* readers wake writers whenever a buffer is freed */
+	pipe_wait(pipe);
+#endif
+}
+
+/* Bytes the page of a buffer holds: framed buffers are compound pages
+ * with PROXYFD_MODE_LARGEBUF. */
+static inline size_t buf_page_size(struct pipe_buffer *buf)
+{
+	return PAGE_SIZE << compound_order(buf->page);
+}
+
+#define LARGE_ORDER get_order(PROXYFD_LARGEBUF_SIZE)
+
+/* Page for a large buffer, if one is to be had cheaply.  Lowmem:
+ * framed writes copy at offsets past the first page. */
+static struct page *large_alloc_page(void)
+{
+	return alloc_pages(GFP_KERNEL | __GFP_ACCOUNT | __GFP_COMP |
+	                   __GFP_NORETRY | __GFP_NOWARN, LARGE_ORDER);
+}
+
+/* State shared by the proxies writing into a pipe, looked up by pipe.
+ * Proxies hold the pipe file, hence the pipe outlives the entry. */
+struct framed_pipe {
+	struct hlist_node       node;
+	struct pipe_inode_info *pipe;
+	refcount_t              ref;
+	u64                     seq;   /* next frame, pipe lock */
+
+	/* deferred reader wakeups, pipe lock */
+	size_t                  wake_bytes;
+	unsigned long           wake_delay;  /* jiffies, 0: off */
+	size_t                  pending;     /* bytes queued since wakeup */
+	struct delayed_work     wake_work;
+
+	/* PERCPU proxies, allocated once the first one attaches */
+	struct framed_stage __percpu *stage;
+	struct delayed_work     stage_work;
+
+	/* last proxy gone with frames staged: a worker puts them in,
+	 * holding the pipe meanwhile */
+	struct file            *file;
+	struct work_struct      free_work;
+
+	unsigned int            weights;  /* sum over weighted proxies */
+
+	struct framed_pool     *pool;
+};
+
+static DEFINE_HASHTABLE(framed_pipes, 8);
+static DEFINE_MUTEX(framed_pipes_lock);
+
+static struct page *pool_alloc_page(struct framed_pipe *fp,
+                                    struct proxy_ctx *ctx)
+{
+	struct framed_pool *pool = fp->pool;
+	struct page *page;
+
+	spin_lock(&pool->lock);
+	page = pool->n ? pool->pages[--pool->n] : NULL;
+	spin_unlock(&pool->lock);
+	if (page) {
+		proxy_stat_add(ctx, PROXY_STAT_RECYCLED, 1);
+		return page;
+	}
+	return alloc_page(GFP_HIGHUSER | __GFP_ACCOUNT);
+}
+
+/* Last proxy gone; buffers still in the pipe free their pages. */
+static void pool_close(struct framed_pipe *fp)
+{
+	struct framed_pool *pool = fp->pool;
+
+	spin_lock(&pool->lock);
+	pool->closed = true;
+	spin_unlock(&pool->lock);
+	pool_put(pool);
+}
+
+/* Based on linux/fs/pipe.c, uncharges the share the buffer belongs to.
+ * Readers wake writers only once a full pipe drains, writers waiting
+ * for their share or for several buffers are woken from here. */
 static void anon_pipe_buf_release(struct pipe_inode_info *pipe,
 				  struct pipe_buffer *buf)
 {
+	struct framed_share *share = buf_share(buf);
+	struct framed_pool *pool = buf_pool(buf);
 	struct page *page = buf->page;
 
-	if (page_count(page) == 1 && !pipe->tmp_page)
+	if (share) {
+		/* a copy made by tee() is released elsewhere */
+		if (share->pipe == pipe)
+			share_uncharge(share, pipe);
+	}
+	if (buf->private & BUF_WAKE)
+		ring_wake_writers(pipe);
+
+	if (page_count(page) == 1 && !pipe->tmp_page && !PageCompound(page))
 		pipe->tmp_page = page;
 	else
-		put_page(page);
+		pool_put_page(pool, page);
+	/* the share holds the pool */
+	if (share)
+		share_put(share);
+	else if (pool)
+		pool_put(pool);
+}
+
+/* Is the page charged to a memory cgroup as kmem? */
+static bool page_kmem_charged(struct page *page)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+	return page_memcg_check(page) != NULL;
+#elif defined(CONFIG_MEMCG)
+	return page->mem_cgroup != NULL;
+#else
+	return false;
+#endif
 }
 
-/* Stealing is prevented. Could've taken linux/fs/pipe.c code but then
- * even more unexported stuff would pop up. */
+/* Based on linux/fs/pipe.c.
+ * Kernel version uncharges kmem before handing the page over, since the
+ * consumer charges it again.  The uncharge helper is unexported, hence
+ * charged pages are not stolen and the consumer falls back to copying.
+ * Pages allocated outside of a memory cgroup (or with kmem accounting
+ * off) are moved. */
+#ifdef PIPE_TRY_STEAL
+static bool anon_pipe_buf_try_steal(struct pipe_inode_info *pipe,
+				    struct pipe_buffer *buf)
+{
+	if (page_kmem_charged(buf->page) || PageCompound(buf->page))
+		return false;
+
+	return generic_pipe_buf_try_steal(pipe, buf);
+}
+#else
 static int anon_pipe_buf_steal(struct pipe_inode_info *pipe,
 			       struct pipe_buffer *buf)
 {
-	return 1;
+	if (page_kmem_charged(buf->page) || PageCompound(buf->page))
+		return 1;
+
+	return generic_pipe_buf_steal(pipe, buf);
+}
+#endif
+
+/* Copies (tee) hold a reference to the share or pool as well. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+static bool anon_pipe_buf_get(struct pipe_inode_info *pipe,
+			      struct pipe_buffer *buf)
+{
+	if (!generic_pipe_buf_get(pipe, buf))
+		return false;
+	if (buf_share(buf))
+		refcount_inc(&buf_share(buf)->ref);
+	else if (buf_pool(buf))
+		refcount_inc(&buf_pool(buf)->ref);
+	return true;
 }
+#else
+static void anon_pipe_buf_get(struct pipe_inode_info *pipe,
+			      struct pipe_buffer *buf)
+{
+	generic_pipe_buf_get(pipe, buf);
+	if (buf_share(buf))
+		refcount_inc(&buf_share(buf)->ref);
+	else if (buf_pool(buf))
+		refcount_inc(&buf_pool(buf)->ref);
+}
+#endif
 
 /* Taken verbatim from linux/fs/pipe.c.
  * Technically, this is distinct from genuine anon_pipe_buf_ops.
@@ -50,180 +619,1401 @@ static int anon_pipe_buf_steal(struct pipe_inode_info *pipe,
  *   * framed writes ignore O_DIRECT (packet mode), normal writes
  *     behave as expected, even if interleaved with framed ones;
  *
- *   * stealing is prevented for buffers spawned by framed writes;
- *     no splicing today.
+ *   * buffers spawned by framed writes can be stolen (SPLICE_F_MOVE)
+ *     unless charged to a memory cgroup, see anon_pipe_buf_steal.
  */
 static const struct pipe_buf_operations anon_pipe_buf_ops =
 {
+#ifdef PIPE_TRY_STEAL
+	.release = anon_pipe_buf_release,
+	.try_steal = anon_pipe_buf_try_steal,
+#else
 	.confirm = generic_pipe_buf_confirm,
 	.release = anon_pipe_buf_release,
 	.steal = anon_pipe_buf_steal,
-	.get = generic_pipe_buf_get,
+#endif
+	.get = anon_pipe_buf_get,
 };
 
-/* Taken verbatim from linux/fs/pipe.c. */
+/* Based on linux/fs/pipe.c.
+ * Page count check: a page shared with another pipe (tee, splice) must
+ * not be written past buf->len, the other pipe may merge there as well. */
 static bool pipe_buf_can_merge(struct pipe_buffer *buf)
 {
-    return buf->ops == &anon_pipe_buf_ops;
+    return buf->ops == &anon_pipe_buf_ops && page_count(buf->page) == 1;
 }
 
 /* Seems identical. */
 #define __pipe_lock   pipe_lock
 #define __pipe_unlock pipe_unlock
 
-#define HDR 4
-
-/* pipe_write from linux/fs/pipe.c with minor changes. */
-ssize_t
-pipe_framed_write(struct file *filp, struct iov_iter *from, __u32 cookie)
-{
-	struct pipe_inode_info *pipe = filp->private_data;
-	ssize_t ret = 0;
-	int do_wakeup = 0;
-	size_t total_len = iov_iter_count(from);
-	size_t overhead;
-	ssize_t chars;
-	char *kaddr;
-	__u32 hdr;
+/* Per-CPU staging page.  Lock order: stage, then pipe. */
+struct framed_stage {
+	struct mutex            lock;
+	struct page            *page;
+	unsigned int            len;
+	unsigned long           gen;   /* bumped as the page goes out */
+};
 
-	/* Null write succeeds. */
-	if (unlikely(total_len == 0))
-		return 0;
+/* Staged frames go out this late at most. */
+#define STAGE_DELAY 1
 
-	__pipe_lock(pipe);
+/* Pipe must be locked: stamped frames take the next sequence number,
+ * fhdr_drop gives it back if the frame doesn't make it. */
+void fhdr_make(const struct proxy_ctx *ctx, struct framed_pipe *fp,
+               struct fhdr *h, size_t chars, bool more)
+{
+	if (ctx->hdr == PROXYFD_HDR_V1) {
+		__u32 info = PROXYFD_HDR_V1 << 24;
 
-	if (!pipe->readers) {
-		send_sig(SIGPIPE, current, 0);
-		ret = -EPIPE;
-		goto out;
+		if (more)
+			info |= PROXYFD_HDR_MORE;
+		if (ctx->mode & PROXYFD_MODE_TS) {
+			info |= PROXYFD_HDR_TS;
+			h->ts.ts = cpu_to_be64(ktime_get_ns());
+			h->ts.seq = cpu_to_be64(fp->seq++);
+		}
+		h->v1.len = cpu_to_be32((__u32)chars);
+		h->v1.info = cpu_to_be32(info);
+		h->v1.stream = cpu_to_be64(ctx->stream);
+	} else {
+		h->v0 = ctx->cookie | htonl((__u32)chars);
 	}
+	h->size = fhdr_size(ctx);
+}
 
-	/* HDR for incomplete page not accounted for in overhead */
-	overhead = (total_len / PAGE_SIZE) * HDR;
+static void fhdr_drop(const struct proxy_ctx *ctx, struct framed_pipe *fp)
+{
+	if (ctx->mode & PROXYFD_MODE_TS)
+		fp->seq--;
+}
 
-	/* We try to merge small writes */
-	chars = (total_len + overhead) & (PAGE_SIZE-1); /* size of the last buffer */
-	if (pipe->nrbufs && chars != 0) {
-		int lastbuf = (pipe->curbuf + pipe->nrbufs - 1) &
-							(pipe->buffers - 1);
-		struct pipe_buffer *buf = pipe->bufs + lastbuf;
-		int offset = buf->offset + buf->len;
+/* Can framed writes go into this pipe? */
+bool pipe_framed_supported(struct file *filp)
+{
+#ifdef CONFIG_WATCH_QUEUE
+	struct pipe_inode_info *pipe = filp->private_data;
 
-		if (pipe_buf_can_merge(buf) && offset + HDR + chars <= PAGE_SIZE) {
-			ret = pipe_buf_confirm(pipe, buf);
-			if (ret)
-				goto out;
-			kaddr = kmap_atomic(buf->page);
-			hdr = cookie | htonl((__u32)chars);
-			memcpy(kaddr + offset, &hdr, 4);
-			ret = copy_from_iter(kaddr + offset + HDR, chars, from);
-			kunmap_atomic(kaddr);
-			if (unlikely(ret < chars)) {
-				ret = -EFAULT;
-				goto out;
-			}
+	/* notification pipe, filled by the kernel */
+	if (pipe->watch_queue)
+		return false;
+#endif
+	return true;
+}
 
-			do_wakeup = 1;
-			buf->len += HDR + ret;
-			if (!iov_iter_count(from))
-				goto out;
-		}
+/* Bytes were added, pipe locked.  Should readers be woken right away?
+ * Otherwise the wakeup is left to wake_work. */
+static bool framed_wake_now(struct framed_pipe *fp, size_t bytes)
+{
+	if (!fp->wake_delay)
+		return true;
+
+	fp->pending += bytes;
+	if (ring_full(fp->pipe) ||
+	    (fp->wake_bytes && fp->pending >= fp->wake_bytes)) {
+		fp->pending = 0;
+		return true;
 	}
+	schedule_delayed_work(&fp->wake_work, fp->wake_delay);
+	return false;
+}
 
-	for (;;) {
-		int bufs;
+/* Readers are about to be woken anyway, pipe locked. */
+static inline void framed_woken(struct framed_pipe *fp)
+{
+	fp->pending = 0;
+}
 
-		if (!pipe->readers) {
-			send_sig(SIGPIPE, current, 0);
-			if (!ret)
-				ret = -EPIPE;
-			break;
-		}
-		bufs = pipe->nrbufs;
-		if (bufs < pipe->buffers) {
-			int newbuf = (pipe->curbuf + bufs) & (pipe->buffers-1);
-			struct pipe_buffer *buf = pipe->bufs + newbuf;
-			struct page *page = pipe->tmp_page;
-			int copied;
+/* Wake readers if there's anything pending; pipe must not be locked. */
+static void framed_flush(struct framed_pipe *fp)
+{
+	size_t pending;
 
-			if (!page) {
-				page = alloc_page(GFP_HIGHUSER | __GFP_ACCOUNT);
-				if (unlikely(!page)) {
-					ret = ret ? : -ENOMEM;
-					break;
-				}
-				pipe->tmp_page = page;
-			}
-			/* Always wake up, even if the copy fails. Otherwise
-			 * we lock up (O_NONBLOCK-)readers that sleep due to
-			 * syscall merging.
-			 * FIXME! Is this really true?
-			 */
-			do_wakeup = 1;
-			kaddr = kmap_atomic(page);
-			copied = copy_from_iter(kaddr + HDR, PAGE_SIZE - HDR, from);
-			if (unlikely(copied < PAGE_SIZE - HDR && iov_iter_count(from))) {
-				kunmap_atomic(kaddr);
-				if (!ret)
-					ret = -EFAULT;
-				break;
-			}
-			hdr = cookie | htonl((__u32)copied);
-			memcpy(kaddr, &hdr, HDR);
-			kunmap_atomic(kaddr);
+	pipe_lock(fp->pipe);
+	pending = fp->pending;
+	fp->pending = 0;
+	pipe_unlock(fp->pipe);
 
-			ret += copied;
+	if (pending)
+		ring_wake_readers(fp->pipe);
+}
 
-			/* Insert it into the buffer array */
-			buf->page = page;
-			buf->ops = &anon_pipe_buf_ops;
-			buf->offset = 0;
-			buf->len = copied + HDR;
-			buf->flags = 0;
-			pipe->nrbufs = ++bufs;
-			pipe->tmp_page = NULL;
+static void framed_wake_work(struct work_struct *work)
+{
+	framed_flush(container_of(to_delayed_work(work), struct framed_pipe,
+	                          wake_work));
+}
 
-			if (!iov_iter_count(from))
-				break;
-		}
-		if (bufs < pipe->buffers)
-			continue;
-		if (filp->f_flags & O_NONBLOCK) {
-			if (!ret)
-				ret = -EAGAIN;
-			break;
+/* Move the staged page into the pipe, stage locked.  Waits for a free
+ * buffer unless nonblock.  Staged data is dropped if there are no
+ * readers left. */
+static int stage_flush(struct framed_pipe *fp, struct framed_stage *st,
+                       bool nonblock)
+{
+	struct pipe_inode_info *pipe = fp->pipe;
+	struct pipe_buffer *buf;
+	bool wake;
+
+	if (!st->len)
+		return 0;
+
+	pipe_lock(pipe);
+	while (ring_full(pipe) && pipe->readers) {
+		if (nonblock) {
+			pipe_unlock(pipe);
+			return -EAGAIN;
 		}
 		if (signal_pending(current)) {
-			if (!ret)
-				ret = -ERESTARTSYS;
-			break;
+			pipe_unlock(pipe);
+			return -ERESTARTSYS;
 		}
-		if (do_wakeup) {
-			wake_up_interruptible_sync_poll(&pipe->wait, EPOLLIN | EPOLLRDNORM);
-			kill_fasync(&pipe->fasync_readers, SIGIO, POLL_IN);
-			do_wakeup = 0;
-		}
-		pipe->waiting_writers++;
-		pipe_wait(pipe);
-		pipe->waiting_writers--;
-	}
-
-out:
-	__pipe_unlock(pipe);
-	if (do_wakeup) {
-		wake_up_interruptible_sync_poll(&pipe->wait, EPOLLIN | EPOLLRDNORM);
-		kill_fasync(&pipe->fasync_readers, SIGIO, POLL_IN);
+		framed_woken(fp);
+		ring_wake_readers(pipe);
+		ring_wait_room(pipe, 1, false);
 	}
-	if (ret > 0 && sb_start_write_trylock(file_inode(filp)->i_sb)) {
-		int err = file_update_time(filp);
-		if (err)
-			ret = err;
-		sb_end_write(file_inode(filp)->i_sb);
+	if (!pipe->readers) {
+		pipe_unlock(pipe);
+		pool_put_page(fp->pool, st->page);
+		st->page = NULL;
+		st->len = 0;
+		st->gen++;
+		return -EPIPE;
 	}
-	return ret;
+
+	buf = ring_head(pipe);
+	buf->page = st->page;
+	buf->ops = &anon_pipe_buf_ops;
+	buf->offset = 0;
+	buf->len = st->len;
+	buf->flags = 0;
+	buf_charge(fp->pool, NULL, buf);
+	ring_push(pipe);
+	wake = framed_wake_now(fp, st->len);
+	pipe_unlock(pipe);
+	if (wake)
+		ring_wake_readers(pipe);
+
+	st->page = NULL;
+	st->len = 0;
+	st->gen++;
+	return 0;
 }
 
-/* Taken verbatim from linux/fs/pipe.c. */
+/* Flush every stage; whatever doesn't fit is retried later.  Returns
+ * whether all of it went out. */
+static bool stage_flush_all(struct framed_pipe *fp)
+{
+	bool again = false;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct framed_stage *st = per_cpu_ptr(fp->stage, cpu);
+
+		mutex_lock(&st->lock);
+		if (stage_flush(fp, st, true) == -EAGAIN)
+			again = true;
+		mutex_unlock(&st->lock);
+	}
+	if (again)
+		schedule_delayed_work(&fp->stage_work, STAGE_DELAY);
+	return !again;
+}
+
+static void stage_work(struct work_struct *work)
+{
+	stage_flush_all(container_of(to_delayed_work(work), struct framed_pipe,
+	                             stage_work));
+}
+
+/* Flush what the proxy left in the stage of a CPU, if it's still there. */
+static int stage_flush_own(struct proxy_target *t, int cpu, bool nonblock)
+{
+	struct framed_stage *st = per_cpu_ptr(t->fp->stage, cpu);
+	int err = 0;
+
+	mutex_lock(&st->lock);
+	if (st->gen == READ_ONCE(t->stage_gen))
+		err = stage_flush(t->fp, st, nonblock);
+	mutex_unlock(&st->lock);
+	return err;
+}
+
+/* Flush the stage the proxy used last: what it writes next, by any
+ * path, comes after. */
+static int stage_flush_last(struct proxy_target *t, bool nonblock)
+{
+	int last = READ_ONCE(t->stage_cpu);
+	int err;
+
+	if (last < 0)
+		return 0;
+	err = stage_flush_own(t, last, nonblock);
+	if (!err)
+		WRITE_ONCE(t->stage_cpu, -1);
+	return err;
+}
+
+static int stage_alloc(struct framed_pipe *fp)
+{
+	int cpu;
+
+	fp->stage = alloc_percpu(struct framed_stage);
+	if (!fp->stage)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		mutex_init(&per_cpu_ptr(fp->stage, cpu)->lock);
+	INIT_DELAYED_WORK(&fp->stage_work, stage_work);
+	return 0;
+}
+
+/* Last proxy gone: out with everything, waiting for room if need be;
+ * dropped only once the readers are gone.  Runs from the free_work,
+ * where no signal cuts the wait short, unless the stages are empty. */
+static void stage_free(struct framed_pipe *fp)
+{
+	int cpu;
+
+	cancel_delayed_work_sync(&fp->stage_work);
+	for_each_possible_cpu(cpu) {
+		struct framed_stage *st = per_cpu_ptr(fp->stage, cpu);
+
+		stage_flush(fp, st, false);
+		if (st->page)
+			pool_put_page(fp->pool, st->page);
+	}
+	free_percpu(fp->stage);
+}
+
+static void framed_free(struct framed_pipe *fp)
+{
+	if (fp->stage)
+		stage_free(fp);
+	cancel_delayed_work_sync(&fp->wake_work);
+	framed_flush(fp);
+	pool_close(fp);
+	kfree(fp);
+}
+
+static void framed_free_work(struct work_struct *work)
+{
+	struct framed_pipe *fp = container_of(work, struct framed_pipe,
+	                                      free_work);
+	struct file *file = fp->file;
+
+	framed_free(fp);
+	fput(file);
+}
+
+int pipe_framed_attach(struct proxy_ctx *ctx, struct proxy_target *t)
+{
+	struct pipe_inode_info *pipe = t->file->private_data;
+	struct framed_pipe *fp;
+	bool created = false;
+
+	mutex_lock(&framed_pipes_lock);
+	hash_for_each_possible(framed_pipes, fp, node, (unsigned long)pipe) {
+		if (fp->pipe == pipe)
+			goto found;
+	}
+
+	fp = kzalloc(sizeof(*fp), GFP_KERNEL_ACCOUNT);
+	if (fp)
+		fp->pool = kzalloc(sizeof(*fp->pool), GFP_KERNEL_ACCOUNT);
+	if (!fp || !fp->pool) {
+		kfree(fp);
+		mutex_unlock(&framed_pipes_lock);
+		return -ENOMEM;
+	}
+	fp->pipe = pipe;
+	refcount_set(&fp->ref, 1);
+	INIT_DELAYED_WORK(&fp->wake_work, framed_wake_work);
+	refcount_set(&fp->pool->ref, 1);
+	spin_lock_init(&fp->pool->lock);
+	hash_add(framed_pipes, &fp->node, (unsigned long)pipe);
+	created = true;
+found:
+	/* PERCPU and weighted proxies don't mix, no stage to undo below */
+	if ((ctx->mode & PROXYFD_MODE_PERCPU) && !fp->stage &&
+	    stage_alloc(fp))
+		goto error_free;
+	if (ctx->weight) {
+		t->share = kzalloc(sizeof(*t->share), GFP_KERNEL_ACCOUNT);
+		if (!t->share)
+			goto error_free;
+		refcount_set(&t->share->ref, 1);
+		t->share->pipe = pipe;
+		t->share->pool = fp->pool;
+		refcount_inc(&fp->pool->ref);
+		t->share->weight = ctx->weight;
+		WRITE_ONCE(fp->weights, fp->weights + ctx->weight);
+	}
+	if (!created)
+		refcount_inc(&fp->ref);
+	mutex_unlock(&framed_pipes_lock);
+	t->fp = fp;
+	t->stage_cpu = -1;
+	return 0;
+
+error_free:
+	if (created) {
+		hash_del(&fp->node);
+		kfree(fp->pool);
+		kfree(fp);
+	}
+	mutex_unlock(&framed_pipes_lock);
+	return -ENOMEM;
+}
+
+void pipe_framed_detach(struct proxy_target *t)
+{
+	struct framed_pipe *fp = t->fp;
+	bool last;
+
+	/* no waiting for the reader here: what doesn't fit goes out with
+	 * the stage_work, or the free_work below */
+	stage_flush_last(t, true);
+
+	mutex_lock(&framed_pipes_lock);
+	if (t->share) {
+		WRITE_ONCE(fp->weights, fp->weights - t->share->weight);
+		share_put(t->share);
+		t->share = NULL;
+	}
+	last = refcount_dec_and_test(&fp->ref);
+	if (last)
+		hash_del(&fp->node);
+	mutex_unlock(&framed_pipes_lock);
+	t->fp = NULL;
+
+	if (!last)
+		return;
+	if (fp->stage && !stage_flush_all(fp)) {
+		/* pipe full: close doesn't wait for the reader */
+		fp->file = get_file(t->file);
+		INIT_WORK(&fp->free_work, framed_free_work);
+		queue_work(proxy_wq, &fp->free_work);
+		return;
+	}
+	framed_free(fp);
+}
+
+int pipe_framed_set_wakeup(struct proxy_target *t,
+                           const struct proxyfd_wakeup *w)
+{
+	struct framed_pipe *fp = t->fp;
+
+	if (w->delay_us > PROXYFD_WAKEUP_DELAY_MAX ||
+	    (w->bytes && !w->delay_us))
+		return -EINVAL;
+
+	pipe_lock(fp->pipe);
+	fp->wake_bytes = w->bytes;
+	fp->wake_delay = 0;
+	if (w->delay_us)
+		fp->wake_delay = max(usecs_to_jiffies(w->delay_us), 1UL);
+	pipe_unlock(fp->pipe);
+
+	/* whatever was held back goes out now */
+	framed_flush(fp);
+	return 0;
+}
+
+void pipe_framed_flush(struct proxy_target *t)
+{
+	if (t->fp->stage)
+		stage_flush_all(t->fp);
+	framed_flush(t->fp);
+}
+
+/* Next sequence number, for fdinfo. */
+u64 pipe_framed_seq(struct proxy_target *t)
+{
+	return READ_ONCE(t->fp->seq);
+}
+
+size_t pipe_framed_lowat_max(struct proxy_ctx *ctx)
+{
+	return PAGE_SIZE - fhdr_size(ctx);
+}
+
+/* Most buffers the share may hold: by weight, out of the pipe. */
+static unsigned int share_limit(struct framed_pipe *fp,
+                                struct framed_share *share)
+{
+	u64 max = (u64)ring_maxbufs(fp->pipe) * share->weight;
+
+	return max_t(unsigned int, div_u64(max, READ_ONCE(fp->weights)), 1);
+}
+
+/* Is the proxy at its share of the pipe?  Lockless, for poll. */
+static bool share_full(struct proxy_ctx *ctx, struct proxy_target *t)
+{
+	struct framed_share *share = t->share;
+	unsigned int limit;
+
+	/* FAIR_DROP writes always go through */
+	if (!share || (ctx->mode & PROXYFD_MODE_FAIR_DROP))
+		return false;
+	limit = share_limit(t->fp, share);
+	if (share_below(share, limit))
+		return false;
+	/* the poller is woken once it's below */
+	share_arm(share, limit);
+	smp_mb(); /* pairs with atomic_dec_return() in share_uncharge */
+	return !share_below(share, limit);
+}
+
+/* Writers of the pipe wait here. */
+wait_queue_head_t *pipe_framed_waitq(struct proxy_target *t)
+{
+	struct pipe_inode_info *pipe = t->file->private_data;
+
+#ifdef PIPE_SPLIT_WAIT
+	return &pipe->wr_wait;
+#else
+	return &pipe->wait;
+#endif
+}
+
+/* pipe_poll from linux/fs/pipe.c, write side only; proxy_poll waits.
+ *
+ * Proxy is writable if there's a free buffer.  With lowat set, a full
+ * pipe still counts as writable if a frame of lowat bytes fits in the
+ * tail of the last buffer.  Lowat is limited to a single buffer: readers
+ * in newer kernels wake writers when a full pipe drains, waiting for
+ * several free buffers we would miss wakeups. */
+__poll_t pipe_framed_poll(struct proxy_ctx *ctx, struct proxy_target *t)
+{
+	struct pipe_inode_info *pipe = t->file->private_data;
+	unsigned int lowat = READ_ONCE(ctx->lowat);
+	__poll_t mask = 0;
+
+	/* Reading only -- no need for acquiring the semaphore. */
+	if (!ring_full(pipe) && !share_full(ctx, t)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	} else if (lowat) {
+		struct pipe_buffer *buf = ring_last(pipe);
+
+		if (buf && pipe_buf_can_merge(buf) &&
+		    READ_ONCE(buf->offset) + READ_ONCE(buf->len) +
+		    fhdr_size(ctx) + lowat <= buf_page_size(buf))
+			mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	if (!pipe->readers)
+		mask |= EPOLLERR;
+
+	return mask;
+}
+
+/* Header for the buffers about to be moved; goes into the tail of the
+ * last buffer if possible, otherwise gets a buffer of its own. */
+static int pipe_put_header(struct proxy_ctx *ctx, struct framed_pipe *fp,
+                           const struct fhdr *h)
+{
+	struct pipe_inode_info *pipe = fp->pipe;
+	struct pipe_buffer *buf;
+	struct page *page;
+	char *kaddr;
+	int ret;
+
+	buf = ring_last(pipe);
+	if (buf) {
+		int offset = buf->offset + buf->len;
+
+		if (pipe_buf_can_merge(buf) &&
+		    offset + h->size <= buf_page_size(buf)) {
+			ret = pipe_buf_confirm(pipe, buf);
+			if (ret)
+				return ret;
+			kaddr = kmap_atomic(buf->page);
+			memcpy(kaddr + offset, h, h->size);
+			kunmap_atomic(kaddr);
+			buf->len += h->size;
+			proxy_stat_add(ctx, PROXY_STAT_MERGED, 1);
+			return 0;
+		}
+	}
+
+	page = pipe->tmp_page;
+	if (!page) {
+		page = pool_alloc_page(fp, ctx);
+		if (unlikely(!page))
+			return -ENOMEM;
+		pipe->tmp_page = page;
+	}
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, h, h->size);
+	kunmap_atomic(kaddr);
+
+	buf = ring_head(pipe);
+	buf->page = page;
+	buf->ops = &anon_pipe_buf_ops;
+	buf->offset = 0;
+	buf->len = h->size;
+	buf->flags = 0;
+	buf_charge(fp->pool, NULL, buf);
+	ring_push(pipe);
+	pipe->tmp_page = NULL;
+	proxy_stat_add(ctx, PROXY_STAT_NEWBUFS, 1);
+	return 0;
+}
+
+/* Does the header fit into the tail of the last buffer? */
+static bool pipe_header_merges(struct pipe_inode_info *pipe, size_t hs)
+{
+	struct pipe_buffer *buf = ring_last(pipe);
+
+	if (!buf)
+		return false;
+
+	return pipe_buf_can_merge(buf) &&
+	       buf->offset + buf->len + hs <= buf_page_size(buf);
+}
+
+/* Framed write in progress. */
+struct fwrite {
+	struct proxy_ctx       *ctx;
+	struct proxy_target    *t;
+	struct file            *filp;
+	struct pipe_inode_info *pipe;
+	struct iov_iter        *from;
+	bool                    nonblock;
+	int                     do_wakeup;
+	bool                    wake_next_writer;
+	struct page            *large;   /* LARGEBUF: next buffer's page */
+	bool                    dropped; /* FAIR_DROP: the rest goes */
+};
+
+/* Most buffers the writer may hold: the pipe, or its share of it. */
+static unsigned int fwrite_maxbufs(struct fwrite *fw)
+{
+	if (fw->t->share)
+		return share_limit(fw->t->fp, fw->t->share);
+	return ring_maxbufs(fw->pipe);
+}
+
+/* Buffers the writer may add right now. */
+static unsigned int fwrite_room(struct fwrite *fw)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	struct framed_share *share = fw->t->share;
+	unsigned int room, max, used;
+
+	if (ring_full(pipe))
+		return 0;
+	room = ring_maxbufs(pipe) - ring_nrbufs(pipe);
+	if (share) {
+		max = share_limit(fw->t->fp, share);
+		used = share_used(share);
+		room = min(room, used < max ? max - used : 0);
+	}
+	return room;
+}
+
+/* Wait until nbufs buffers are free; pipe lock is dropped meanwhile.
+ * Returns 0 or an error to end the write with. */
+static int fwrite_wait(struct fwrite *fw, unsigned int nbufs)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	u64 wait_start;
+
+	/* no room in the share: FAIR_DROP never waits for it */
+	if ((fw->ctx->mode & PROXYFD_MODE_FAIR_DROP) &&
+	    share_used(fw->t->share) + nbufs > fwrite_maxbufs(fw)) {
+		fw->dropped = true;
+		return -ENOSPC;
+	}
+	if (fw->nonblock) {
+		proxy_stat_add(fw->ctx, PROXY_STAT_EAGAIN, 1);
+		return -EAGAIN;
+	}
+	if (signal_pending(current))
+		return -ERESTARTSYS;
+	if (fw->do_wakeup) {
+		framed_woken(fw->t->fp);
+		ring_wake_readers(pipe);
+		fw->do_wakeup = 0;
+	}
+	wait_start = ktime_get_ns();
+	if (fw->t->share && ring_nrbufs(pipe) + nbufs <= ring_maxbufs(pipe)) {
+		unsigned int max = fwrite_maxbufs(fw);
+
+		/* room in the pipe, not in the share */
+		share_wait(fw->t->share, max - min(nbufs, max) + 1);
+	} else {
+		fw->wake_next_writer = ring_wait_room(pipe, nbufs, true);
+	}
+	proxy_stat_add(fw->ctx, PROXY_STAT_WAIT_NS,
+	               ktime_get_ns() - wait_start);
+	return 0;
+}
+
+/* Append a frame of chars bytes to the last buffer.
+ * Returns chars, 0 if it doesn't fit, or an error. */
+static ssize_t fwrite_merge(struct fwrite *fw, size_t chars)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	struct pipe_buffer *buf = ring_last(pipe);
+	size_t copied;
+	char *kaddr;
+	int offset, err;
+	__u32 hdr;
+
+	if (!buf)
+		return 0;
+
+	offset = buf->offset + buf->len;
+	if (!pipe_buf_can_merge(buf) ||
+	    offset + HDR + chars > buf_page_size(buf))
+		return 0;
+
+	err = pipe_buf_confirm(pipe, buf);
+	if (err)
+		return err;
+	kaddr = kmap_atomic(buf->page);
+	hdr = fw->ctx->cookie | htonl((__u32)chars);
+	memcpy(kaddr + offset, &hdr, HDR);
+	kunmap_atomic(kaddr);
+	/* may fault: not under an atomic kmap */
+	copied = copy_page_from_iter(buf->page, offset + HDR, chars, fw->from);
+	if (unlikely(copied < chars))
+		return -EFAULT;
+
+	fw->do_wakeup = 1;
+	buf->len += HDR + copied;
+	proxy_stat_add(fw->ctx, PROXY_STAT_MERGED, 1);
+	proxy_stat_add(fw->ctx, PROXY_STAT_FRAMES, 1);
+	return copied;
+}
+
+/* New buffer holding a frame of chars bytes, pipe must not be full.
+ * Returns chars or an error. */
+static ssize_t fwrite_newbuf(struct fwrite *fw, size_t chars)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	struct pipe_buffer *buf = ring_head(pipe);
+	struct page *page = pipe->tmp_page;
+	size_t copied;
+	char *kaddr;
+	__u32 hdr;
+
+	if (!page) {
+		page = pool_alloc_page(fw->t->fp, fw->ctx);
+		if (unlikely(!page))
+			return -ENOMEM;
+		pipe->tmp_page = page;
+	}
+	/* Always wake up, even if the copy fails. Otherwise
+	 * we lock up (O_NONBLOCK-)readers that sleep due to
+	 * syscall merging.
+	 * FIXME! Is this really true?
+	 */
+	fw->do_wakeup = 1;
+	copied = copy_page_from_iter(page, HDR, chars, fw->from);
+	if (unlikely(copied < chars))
+		return -EFAULT;
+	hdr = fw->ctx->cookie | htonl((__u32)copied);
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, &hdr, HDR);
+	kunmap_atomic(kaddr);
+
+	/* Insert it into the buffer array */
+	buf->page = page;
+	buf->ops = &anon_pipe_buf_ops;
+	buf->offset = 0;
+	buf->len = copied + HDR;
+	buf->flags = 0;
+	buf_charge(fw->t->fp->pool, fw->t->share, buf);
+	ring_push(pipe);
+	pipe->tmp_page = NULL;
+	proxy_stat_add(fw->ctx, PROXY_STAT_NEWBUFS, 1);
+	proxy_stat_add(fw->ctx, PROXY_STAT_FRAMES, 1);
+	return copied;
+}
+
+/* Bytes left in the last buffer, if we may append there. */
+static size_t fwrite_tail(struct pipe_inode_info *pipe)
+{
+	struct pipe_buffer *buf = ring_last(pipe);
+
+	if (buf && pipe_buf_can_merge(buf))
+		return buf_page_size(buf) - (buf->offset + buf->len);
+	return 0;
+}
+
+/* Bytes the buffers the writer may add take. */
+static size_t fwrite_free(struct fwrite *fw)
+{
+	return (size_t)fwrite_room(fw) * PAGE_SIZE;
+}
+
+/* LARGEBUF: bytes the next new buffer takes, a large one if there's a
+ * page for it; a frame takes a single large buffer at most. */
+static size_t fwrite_free_large(struct fwrite *fw)
+{
+	if (!fwrite_room(fw))
+		return 0;
+	if (!fw->large)
+		fw->large = large_alloc_page();
+	if (!fw->large)
+		return fwrite_free(fw);
+	return PROXYFD_LARGEBUF_SIZE;
+}
+
+/* Append a frame of chars bytes, filling the tail of the last buffer
+ * (if use_tail) and then as many new buffers as needed; the header may
+ * be split as well.  Caller makes sure there's room.
+ * On error, whatever was appended is taken back.
+ * Returns chars or an error. */
+static ssize_t fwrite_frame(struct fwrite *fw, size_t chars, bool use_tail,
+                            bool more)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	struct pipe_buffer *last = ring_last(pipe);
+	unsigned int last_len = last ? last->len : 0;
+	unsigned int pushed = 0;
+	struct fhdr h;
+	size_t off = 0, total;
+	int err = 0;
+
+	fhdr_make(fw->ctx, fw->t->fp, &h, chars, more);
+	total = h.size + chars;
+
+	while (off < total) {
+		struct pipe_buffer *buf = ring_last(pipe);
+		size_t pos, n, copied = 0;
+		char *kaddr;
+
+		if (buf && (use_tail || pushed) && pipe_buf_can_merge(buf) &&
+		    buf->offset + buf->len < buf_page_size(buf)) {
+			if (!pushed) {
+				err = pipe_buf_confirm(pipe, buf);
+				if (err)
+					break;
+			}
+		} else {
+			struct page *page = pipe->tmp_page;
+
+			if (fw->large) {
+				page = fw->large;
+				fw->large = NULL;
+			} else if (page) {
+				pipe->tmp_page = NULL;
+			} else {
+				page = pool_alloc_page(fw->t->fp, fw->ctx);
+				if (unlikely(!page)) {
+					err = -ENOMEM;
+					break;
+				}
+			}
+			buf = ring_head(pipe);
+			buf->page = page;
+			buf->ops = &anon_pipe_buf_ops;
+			buf->offset = 0;
+			buf->len = 0;
+			buf->flags = 0;
+			buf_charge(fw->t->fp->pool, fw->t->share, buf);
+			ring_push(pipe);
+			pushed++;
+		}
+
+		pos = buf->offset + buf->len;
+		n = min_t(size_t, total - off, buf_page_size(buf) - pos);
+		if (off < h.size) {
+			copied = min_t(size_t, n, h.size - off);
+			kaddr = kmap_atomic(buf->page);
+			memcpy(kaddr + pos, (char *)&h + off, copied);
+			kunmap_atomic(kaddr);
+		}
+		if (copied < n)
+			copied += copy_page_from_iter(buf->page, pos + copied,
+			                              n - copied, fw->from);
+		buf->len += copied;
+		off += copied;
+		if (unlikely(copied < n)) {
+			err = -EFAULT;
+			break;
+		}
+	}
+
+	if (unlikely(err)) {
+		fhdr_drop(fw->ctx, fw->t->fp);
+		while (pushed--) {
+			ring_unpush(pipe);
+			anon_pipe_buf_release(pipe, ring_head(pipe));
+		}
+		if (last)
+			last->len = last_len;
+		if (off > h.size)
+			iov_iter_revert(fw->from, off - h.size);
+		return err;
+	}
+
+	fw->do_wakeup = 1;
+	if (last && last->len != last_len)
+		proxy_stat_add(fw->ctx, PROXY_STAT_MERGED, 1);
+	proxy_stat_add(fw->ctx, PROXY_STAT_NEWBUFS, pushed);
+	proxy_stat_add(fw->ctx, PROXY_STAT_FRAMES, 1);
+	return chars;
+}
+
+/* Record as frames spanning buffers (packed mode, V1 header or large
+ * buffers).  A frame the pipe (or the writer's share) can take goes in
+ * whole, the writer waits for room for it; non-blocking writers and
+ * longer records get frames sized to the room.  Unless packed, a frame
+ * goes into the tail of the last buffer only if it fits there whole. */
+static ssize_t fwrite_record_frames(struct fwrite *fw, size_t len)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	bool packed = fw->ctx->mode & PROXYFD_MODE_PACKED;
+	bool large = fw->ctx->mode & PROXYFD_MODE_LARGEBUF;
+	size_t hs = fhdr_size(fw->ctx);
+	size_t frame_max = fhdr_frame_max(fw->ctx);
+	ssize_t ret = 0, n;
+	size_t tail, room, chars;
+	unsigned int nbufs;
+	int err;
+
+	while (ret < len) {
+		if (!pipe->readers) {
+			send_sig(SIGPIPE, current, 0);
+			return ret ? : -EPIPE;
+		}
+		chars = min(len - ret, frame_max);
+		tail = fwrite_tail(pipe);
+		if (!packed && hs + chars > tail)
+			tail = 0;
+		room = tail;
+		/* no large page taken for a frame going into the tail */
+		if (hs + chars > tail)
+			room += large ? fwrite_free_large(fw) : fwrite_free(fw);
+		if (room < hs + chars) {
+			/* room for the whole frame, else any room at all */
+			nbufs = DIV_ROUND_UP(hs + chars - tail, PAGE_SIZE);
+			if (large || fw->nonblock || nbufs > fwrite_maxbufs(fw))
+				nbufs = room <= hs;
+			if (nbufs) {
+				err = fwrite_wait(fw, nbufs);
+				if (err)
+					return ret ? : err;
+				continue;
+			}
+		}
+		chars = min(chars, room - hs);
+		n = fwrite_frame(fw, chars, tail != 0, ret + chars < len);
+		if (n < 0)
+			return ret ? : n;
+		ret += n;
+	}
+	return ret;
+}
+
+/* Pages of a zero-copy writer, referenced by the pipe rather than
+ * copied; never stolen nor appended to. */
+static void user_page_pipe_buf_release(struct pipe_inode_info *pipe,
+                                       struct pipe_buffer *buf)
+{
+	if (buf->private & BUF_WAKE)
+		ring_wake_writers(pipe);
+	put_page(buf->page);
+}
+
+static const struct pipe_buf_operations user_page_pipe_buf_ops =
+{
+#ifdef PIPE_TRY_STEAL
+	.release = user_page_pipe_buf_release,
+#else
+	.confirm = generic_pipe_buf_confirm,
+	.release = user_page_pipe_buf_release,
+	.steal = generic_pipe_buf_nosteal,
+#endif
+	.get = generic_pipe_buf_get,
+};
+
+/* Most pages a zero-copy frame takes. */
+#define ZC_PAGES 16
+
+/* Take references to the user pages behind up to maxsize bytes of i,
+ * advancing it.  Returns bytes or an error, the offset into the first
+ * page in *start. */
+static ssize_t iter_get_pages(struct iov_iter *i, struct page **pages,
+                              size_t maxsize, unsigned int maxpages,
+                              size_t *start)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	return iov_iter_get_pages2(i, pages, maxsize, maxpages, start);
+#else
+	ssize_t n = iov_iter_get_pages(i, pages, maxsize, maxpages, start);
+
+	if (n > 0)
+		iov_iter_advance(i, n);
+	return n;
+#endif
+}
+
+static bool iter_is_user(const struct iov_iter *i)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	return user_backed_iter(i);
+#else
+	return iter_is_iovec(i);
+#endif
+}
+
+/* PROXYFD_MODE_ZEROCOPY: record of len bytes as frames of the writer's
+ * own pages, each behind a header (merged into the last buffer or in a
+ * buffer of its own).  Frames are sized to the room in the pipe, as in
+ * fwrite_record_frames, and to ZC_PAGES.
+ * Returns bytes written or an error. */
+static ssize_t fwrite_zerocopy(struct fwrite *fw, size_t len)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	size_t hs = fhdr_size(fw->ctx);
+	size_t frame_max = fhdr_frame_max(fw->ctx);
+	struct page *pages[ZC_PAGES];
+	unsigned int offs[ZC_PAGES], lens[ZC_PAGES];
+	ssize_t ret = 0;
+
+	while (ret < len) {
+		unsigned int room, hbufs, npages = 0, i;
+		size_t chars = 0, want, start;
+		struct fhdr h;
+		ssize_t n = 0;
+		int err;
+
+		if (!pipe->readers) {
+			send_sig(SIGPIPE, current, 0);
+			return ret ? : -EPIPE;
+		}
+		room = fwrite_room(fw);
+		hbufs = !pipe_header_merges(pipe, hs);
+		if (room <= hbufs) {
+			err = fwrite_wait(fw, hbufs + 1);
+			if (err)
+				return ret ? : err;
+			continue;
+		}
+		room = min_t(unsigned int, room - hbufs, ZC_PAGES);
+
+		/* pin first: the header carries the length */
+		want = min(len - ret, frame_max);
+		while (chars < want && npages < room) {
+			n = iter_get_pages(fw->from, pages + npages, want - chars,
+			                   room - npages, &start);
+			if (n <= 0)
+				break;
+			chars += n;
+			while (n > 0) {
+				lens[npages] = min_t(size_t, n, PAGE_SIZE - start);
+				offs[npages] = start;
+				n -= lens[npages++];
+				start = 0;
+			}
+		}
+		if (!chars)
+			return ret ? : (n < 0 ? n : -EFAULT);
+
+		fhdr_make(fw->ctx, fw->t->fp, &h, chars, ret + chars < len);
+		err = pipe_put_header(fw->ctx, fw->t->fp, &h);
+		if (unlikely(err)) {
+			fhdr_drop(fw->ctx, fw->t->fp);
+			iov_iter_revert(fw->from, chars);
+			for (i = 0; i < npages; i++)
+				put_page(pages[i]);
+			return ret ? : err;
+		}
+		for (i = 0; i < npages; i++) {
+			struct pipe_buffer *buf = ring_head(pipe);
+
+			buf->page = pages[i];
+			buf->ops = &user_page_pipe_buf_ops;
+			buf->offset = offs[i];
+			buf->len = lens[i];
+			buf->flags = 0;
+			buf->private = 0;
+			ring_push(pipe);
+		}
+		fw->do_wakeup = 1;
+		proxy_stat_add(fw->ctx, PROXY_STAT_NEWBUFS, npages);
+		proxy_stat_add(fw->ctx, PROXY_STAT_FRAMES, 1);
+		ret += chars;
+	}
+	return ret;
+}
+
+/* Append a record of len bytes, split in frames of at most a buffer
+ * each.  Waits for room unless O_NONBLOCK.
+ * Returns bytes written or an error. */
+static ssize_t fwrite_record(struct fwrite *fw, size_t len)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	/* HDR for incomplete page not accounted for in overhead */
+	size_t overhead = (len / PAGE_SIZE) * HDR;
+	/* size of the last buffer */
+	size_t chars = (len + overhead) & (PAGE_SIZE-1);
+	ssize_t ret = 0, n;
+	int err;
+
+	if (fw->ctx->mode & (PROXYFD_MODE_PACKED | PROXYFD_MODE_LARGEBUF) ||
+	    fw->ctx->hdr != PROXYFD_HDR_V0)
+		return fwrite_record_frames(fw, len);
+
+	/* We try to merge small writes */
+	if (chars != 0) {
+		ret = fwrite_merge(fw, chars);
+		if (ret < 0)
+			return ret;
+	}
+
+	while (ret < len) {
+		if (!pipe->readers) {
+			send_sig(SIGPIPE, current, 0);
+			return ret ? : -EPIPE;
+		}
+		if (!fwrite_room(fw)) {
+			err = fwrite_wait(fw, 1);
+			if (err)
+				return ret ? : err;
+			continue;
+		}
+		n = fwrite_newbuf(fw, min_t(size_t, len - ret, PAGE_SIZE - HDR));
+		if (n < 0)
+			return ret ? : n;
+		ret += n;
+	}
+	return ret;
+}
+
+static const struct iovec *iter_iovec(const struct iov_iter *i)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+	return iter_iov(i);
+#else
+	return i->iov;
+#endif
+}
+
+/* Length of the current iovec (empty ones skipped). */
+static size_t iov_iter_seglen(const struct iov_iter *i)
+{
+	const struct iovec *iov;
+	size_t skip = i->iov_offset;
+
+	if (!iter_is_iovec(i))
+		return iov_iter_count(i);
+
+	for (iov = iter_iovec(i); iov->iov_len == skip; iov++)
+		skip = 0;
+
+	return min(iov_iter_count(i), iov->iov_len - skip);
+}
+
+/* Buffers a record of len bytes needs at most, nothing merged.  PACKED
+ * frames fill the pages back to back, as fwrite_record_nbufs counts. */
+static size_t fwrite_record_maxbufs(struct fwrite *fw, size_t len)
+{
+	size_t frames = DIV_ROUND_UP(len, fhdr_frame_max(fw->ctx));
+
+	if (fw->ctx->mode & PROXYFD_MODE_PACKED)
+		return DIV_ROUND_UP(len + frames * fhdr_size(fw->ctx),
+		                    PAGE_SIZE);
+	if (fw->ctx->hdr == PROXYFD_HDR_V1)
+		return DIV_ROUND_UP(len + fhdr_size(fw->ctx), PAGE_SIZE);
+	return DIV_ROUND_UP(len, PAGE_SIZE - HDR);
+}
+
+/* Buffers needed for a record per iovec write, assuming nothing is
+ * merged. */
+static size_t fwrite_nbufs(struct fwrite *fw, const struct iov_iter *i)
+{
+	const struct iovec *iov;
+	size_t left = iov_iter_count(i);
+	size_t skip = i->iov_offset;
+	size_t nbufs = 0;
+
+	if (!iter_is_iovec(i))
+		return fwrite_record_maxbufs(fw, left);
+
+	for (iov = iter_iovec(i); left; iov++, skip = 0) {
+		size_t len = min(left, iov->iov_len - skip);
+
+		nbufs += fwrite_record_maxbufs(fw, len);
+		left -= len;
+	}
+	return nbufs;
+}
+
+/* Buffers needed for a single record of len bytes right now, i.e. with
+ * the first frame merged into the last buffer if it fits (as
+ * fwrite_record does). */
+static size_t fwrite_record_nbufs(struct fwrite *fw, size_t len)
+{
+	struct pipe_inode_info *pipe = fw->pipe;
+	size_t chars = (len + (len / PAGE_SIZE) * HDR) & (PAGE_SIZE-1);
+	struct pipe_buffer *buf = ring_last(pipe);
+
+	if (fw->ctx->mode & (PROXYFD_MODE_PACKED | PROXYFD_MODE_LARGEBUF) ||
+	    fw->ctx->hdr != PROXYFD_HDR_V0) {
+		size_t frame_max = fhdr_frame_max(fw->ctx);
+		size_t total = len + DIV_ROUND_UP(len, frame_max) *
+		                     fhdr_size(fw->ctx);
+		size_t tail = fwrite_tail(pipe);
+
+		/* see fwrite_record_frames */
+		if (!(fw->ctx->mode & PROXYFD_MODE_PACKED) &&
+		    fhdr_size(fw->ctx) + min(len, frame_max) > tail)
+			tail = 0;
+		return total > tail ? DIV_ROUND_UP(total - tail, PAGE_SIZE) : 0;
+	}
+
+	if (chars && buf && pipe_buf_can_merge(buf) &&
+	    buf->offset + buf->len + HDR + chars <= buf_page_size(buf))
+		len -= chars;
+	return DIV_ROUND_UP(len, PAGE_SIZE - HDR);
+}
+
+/* PERCPU mode: append the record to the stage of this CPU.  The pipe
+ * lock is taken only when a full page goes out.  A record too large for
+ * a page is not staged, 0 is returned; it's up to the caller to write it
+ * directly, frames staged earlier are in the pipe by then.
+ * Returns bytes written, 0 or an error. */
+static ssize_t fwrite_staged(struct fwrite *fw, bool nowait)
+{
+	struct proxy_ctx *ctx = fw->ctx;
+	struct proxy_target *t = fw->t;
+	struct framed_pipe *fp = t->fp;
+	size_t len = iov_iter_count(fw->from);
+	size_t hs = fhdr_size(ctx);
+	int cpu = raw_smp_processor_id();
+	int last = READ_ONCE(t->stage_cpu);
+	struct framed_stage *st;
+	size_t copied;
+	struct fhdr h;
+	char *kaddr;
+	ssize_t ret;
+
+	if (!READ_ONCE(fw->pipe->readers)) {
+		send_sig(SIGPIPE, current, 0);
+		return -EPIPE;
+	}
+
+	/* Frames of the proxy keep their order: whatever it left in the
+	 * stage of another CPU goes first. */
+	if (last >= 0 && (last != cpu || hs + len > PAGE_SIZE)) {
+		ret = stage_flush_last(t, fw->nonblock);
+		if (ret)
+			goto err;
+	}
+	if (hs + len > PAGE_SIZE)
+		return 0;
+
+	st = per_cpu_ptr(fp->stage, cpu);
+	if (nowait) {
+		if (!mutex_trylock(&st->lock)) {
+			ret = -EAGAIN;
+			goto err;
+		}
+	} else {
+		mutex_lock(&st->lock);
+	}
+
+	if (st->len + hs + len > PAGE_SIZE) {
+		ret = stage_flush(fp, st, fw->nonblock);
+		if (ret)
+			goto unlock;
+	}
+	if (!st->page) {
+		st->page = pool_alloc_page(fp, ctx);
+		if (unlikely(!st->page)) {
+			ret = -ENOMEM;
+			goto unlock;
+		}
+		proxy_stat_add(ctx, PROXY_STAT_NEWBUFS, 1);
+	}
+
+	/* may fault, we're allowed to sleep here */
+	fhdr_make(ctx, fp, &h, len, false);
+	kaddr = kmap(st->page);
+	memcpy(kaddr + st->len, &h, h.size);
+	copied = copy_from_iter(kaddr + st->len + h.size, len, fw->from);
+	kunmap(st->page);
+	if (unlikely(copied < len)) {
+		iov_iter_revert(fw->from, copied);
+		ret = -EFAULT;
+		goto unlock;
+	}
+	st->len += h.size + len;
+	WRITE_ONCE(t->stage_gen, st->gen);
+	WRITE_ONCE(t->stage_cpu, cpu);
+	ret = len;
+	schedule_delayed_work(&fp->stage_work, STAGE_DELAY);
+unlock:
+	mutex_unlock(&st->lock);
+	if (ret > 0) {
+		proxy_stat_add(ctx, PROXY_STAT_FRAMES, 1);
+		proxy_stat_add(ctx, PROXY_STAT_BYTES, ret);
+		return ret;
+	}
+err:
+	if (ret == -EAGAIN)
+		proxy_stat_add(ctx, PROXY_STAT_EAGAIN, 1);
+	else if (ret == -EPIPE)
+		send_sig(SIGPIPE, current, 0);
+	return ret;
+}
+
+/* pipe_write from linux/fs/pipe.c, reorganized.
+ *
+ * A write is a single record, or a record per iovec with
+ * PROXYFD_MODE_IOVEC.  In the latter case we wait for room for the whole
+ * group first, so that it goes in atomically.  A group larger than the
+ * pipe is inserted piecemeal, as a regular large write.
+ *
+ * PROXYFD_MODE_ATOMIC does the same for any write, and a write larger
+ * than the pipe fails instead.  Once there's room, only a fault or a
+ * failed allocation may cut the write short. */
+ssize_t
+pipe_framed_write(struct proxy_ctx *ctx, struct proxy_target *t,
+                  struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *filp = t->file;
+	bool nowait = iocb_nowait(iocb);
+	struct fwrite fw = {
+		.ctx  = ctx,
+		.t    = t,
+		.filp = filp,
+		.pipe = filp->private_data,
+		.from = from,
+		/* either end being non-blocking will do */
+		.nonblock = nowait || (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+		            (filp->f_flags & O_NONBLOCK),
+	};
+	struct pipe_inode_info *pipe = fw.pipe;
+	bool per_iov = ctx->mode & PROXYFD_MODE_IOVEC;
+	bool atomic = ctx->mode & PROXYFD_MODE_ATOMIC;
+	size_t total_len = iov_iter_count(from);
+	ssize_t ret = 0, n;
+
+	/* Null write succeeds. */
+	if (unlikely(total_len == 0))
+		return 0;
+
+	if (atomic && ctx->max_atomic && total_len > ctx->max_atomic)
+		return -EMSGSIZE;
+
+	if (ctx->mode & PROXYFD_MODE_PERCPU) {
+		ret = fwrite_staged(&fw, nowait);
+		if (ret)
+			return ret;
+	}
+
+	/* io_uring: don't sleep on the lock either, the write is retried
+	 * from a worker thread */
+	if (nowait) {
+		if (!mutex_trylock(&pipe->mutex)) {
+			proxy_stat_add(ctx, PROXY_STAT_EAGAIN, 1);
+			return -EAGAIN;
+		}
+	} else {
+		__pipe_lock(pipe);
+	}
+
+	if (!pipe->readers) {
+		send_sig(SIGPIPE, current, 0);
+		ret = -EPIPE;
+		goto out;
+	}
+
+	/* over its share: the write is dropped rather than waited for */
+	if ((ctx->mode & PROXYFD_MODE_FAIR_DROP) &&
+	    share_used(t->share) >= fwrite_maxbufs(&fw)) {
+		__pipe_unlock(pipe);
+		proxy_stat_add(ctx, PROXY_STAT_DROPPED, 1);
+		iov_iter_advance(from, total_len);
+		return total_len;
+	}
+
+	if ((ctx->mode & PROXYFD_MODE_ZEROCOPY) &&
+	    total_len >= PROXYFD_ZEROCOPY_MIN && iter_is_user(from)) {
+		ret = fwrite_zerocopy(&fw, total_len);
+		goto out;
+	}
+
+	if (per_iov || atomic) {
+		/* nothing merged */
+		size_t maxbufs = per_iov ? fwrite_nbufs(&fw, from) :
+		                 fwrite_record_maxbufs(&fw, total_len);
+		size_t nbufs;
+
+		for (;;) {
+			if (maxbufs > fwrite_maxbufs(&fw)) {
+				if (!atomic)
+					break;
+				ret = -EMSGSIZE;
+				goto out;
+			}
+			nbufs = per_iov ? maxbufs :
+			        fwrite_record_nbufs(&fw, total_len);
+			if (nbufs <= fwrite_room(&fw))
+				break;
+			if (!pipe->readers) {
+				send_sig(SIGPIPE, current, 0);
+				ret = -EPIPE;
+				goto out;
+			}
+			ret = fwrite_wait(&fw, nbufs);
+			if (ret)
+				goto out;
+		}
+	}
+
+	while (iov_iter_count(from)) {
+		size_t len = per_iov ? iov_iter_seglen(from) :
+		                       iov_iter_count(from);
+
+		n = fwrite_record(&fw, len);
+		if (n < 0) {
+			if (!ret)
+				ret = n;
+			break;
+		}
+		ret += n;
+		if (n < len)
+			break;
+	}
+
+out:
+	/* Exclusive waiters: pass the wakeup on if there's room left. */
+	if (ring_full(pipe))
+		fw.wake_next_writer = false;
+	if (fw.do_wakeup && !framed_wake_now(t->fp, ret > 0 ? ret : 0))
+		fw.do_wakeup = 0;
+	__pipe_unlock(pipe);
+	if (fw.do_wakeup)
+		ring_wake_readers(pipe);
+	if (fw.wake_next_writer)
+		ring_wake_writers(pipe);
+	if (fw.large)
+		put_page(fw.large);
+	if (ret > 0)
+		proxy_stat_add(ctx, PROXY_STAT_BYTES, ret);
+	if (fw.dropped) {
+		/* reported as written, as if dropped from the start */
+		proxy_stat_add(ctx, PROXY_STAT_DROPPED, 1);
+		iov_iter_advance(from, iov_iter_count(from));
+		ret = total_len;
+	}
+	if (ret > 0 && sb_start_write_trylock(file_inode(filp)->i_sb)) {
+		int err = file_update_time(filp);
+		if (err)
+			ret = err;
+		sb_end_write(file_inode(filp)->i_sb);
+	}
+	return ret;
+}
+
+#ifndef PIPE_SPLIT_WAIT
+/* Taken verbatim from linux/fs/pipe.c. */
 void pipe_wait(struct pipe_inode_info *pipe)
 {
 	DEFINE_WAIT(wait);
@@ -238,3 +2028,689 @@ void pipe_wait(struct pipe_inode_info *pipe)
 	finish_wait(&pipe->wait, &wait);
 	pipe_lock(pipe);
 }
+#endif
+
+/* Taken verbatim from linux/fs/splice.c. */
+static int ipipe_prep(struct pipe_inode_info *pipe, unsigned int flags)
+{
+	int ret;
+
+	/*
+	 * Check the pipe occupancy without the inode lock first. This function
+	 * is speculative anyways, so missing one is ok.
+	 */
+	if (ring_nrbufs(pipe))
+		return 0;
+
+	ret = 0;
+	pipe_lock(pipe);
+
+	while (!ring_nrbufs(pipe)) {
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		if (!pipe->writers)
+			break;
+		if (flags & SPLICE_F_NONBLOCK) {
+			ret = -EAGAIN;
+			break;
+		}
+		ring_wait_readable(pipe);
+	}
+
+	pipe_unlock(pipe);
+	return ret;
+}
+
+/* Taken verbatim from linux/fs/splice.c. */
+static int opipe_prep(struct pipe_inode_info *pipe, unsigned int flags)
+{
+	int ret;
+
+	/*
+	 * Check pipe occupancy without the inode lock first. This function
+	 * is speculative anyways, so missing one is ok.
+	 */
+	if (!ring_full(pipe))
+		return 0;
+
+	ret = 0;
+	pipe_lock(pipe);
+
+	while (ring_full(pipe)) {
+		if (!pipe->readers) {
+			send_sig(SIGPIPE, current, 0);
+			ret = -EPIPE;
+			break;
+		}
+		if (flags & SPLICE_F_NONBLOCK) {
+			ret = -EAGAIN;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		ring_wait_room(pipe, 1, false);
+	}
+
+	pipe_unlock(pipe);
+	return ret;
+}
+
+/* Based on linux/fs/pipe.c; pipe_lock_nested is static there. */
+static void pipe_lock_nested(struct pipe_inode_info *pipe, int subclass)
+{
+	if (pipe->files)
+		mutex_lock_nested(&pipe->mutex, subclass);
+}
+
+static void framed_double_lock(struct pipe_inode_info *pipe1,
+                               struct pipe_inode_info *pipe2)
+{
+	if (pipe1 < pipe2) {
+		pipe_lock_nested(pipe1, I_MUTEX_PARENT);
+		pipe_lock_nested(pipe2, I_MUTEX_CHILD);
+	} else {
+		pipe_lock_nested(pipe2, I_MUTEX_PARENT);
+		pipe_lock_nested(pipe1, I_MUTEX_CHILD);
+	}
+}
+
+/* Drop the head buffer of the input pipe. */
+static void ipipe_consume(struct pipe_inode_info *ipipe,
+                          struct pipe_buffer *ibuf)
+{
+	if (ibuf->ops)
+		pipe_buf_release(ipipe, ibuf);
+	ibuf->ops = NULL;
+	ring_pop(ipipe);
+}
+
+/* Copy chars from the head buffer of ipipe into a fresh framed buffer.
+ * Used when the input buffer can't be moved as a whole. */
+static int pipe_framed_copy(struct proxy_ctx *ctx, struct framed_pipe *fp,
+                            struct pipe_inode_info *ipipe,
+                            struct pipe_inode_info *opipe, size_t chars)
+{
+	struct pipe_buffer *ibuf = ring_buf(ipipe, 0);
+	struct pipe_buffer *obuf = ring_head(opipe);
+	struct page *page = opipe->tmp_page;
+	char *src, *dst;
+	struct fhdr h;
+	int ret;
+
+	ret = pipe_buf_confirm(ipipe, ibuf);
+	if (ret)
+		return ret;
+
+	if (!page) {
+		page = pool_alloc_page(fp, ctx);
+		if (unlikely(!page))
+			return -ENOMEM;
+		opipe->tmp_page = page;
+	}
+
+	fhdr_make(ctx, fp, &h, chars, false);
+	dst = kmap_atomic(page);
+	src = kmap_atomic(ibuf->page);
+	memcpy(dst, &h, h.size);
+	memcpy(dst + h.size, src + ibuf->offset, chars);
+	kunmap_atomic(src);
+	kunmap_atomic(dst);
+
+	obuf->page = page;
+	obuf->ops = &anon_pipe_buf_ops;
+	obuf->offset = 0;
+	obuf->len = chars + h.size;
+	obuf->flags = 0;
+	buf_charge(fp->pool, NULL, obuf);
+	ring_push(opipe);
+	opipe->tmp_page = NULL;
+	proxy_stat_add(ctx, PROXY_STAT_NEWBUFS, 1);
+
+	ibuf->offset += chars;
+	ibuf->len -= chars;
+	if (!ibuf->len)
+		ipipe_consume(ipipe, ibuf);
+
+	return 0;
+}
+
+/* splice_pipe_to_pipe from linux/fs/splice.c, framed.
+ *
+ * Whole input buffers are moved into the output pipe behind a header,
+ * page references change hands, no data is copied.  A frame is inserted
+ * under a single lock hold, hence atomic, same as with
+ * pipe_framed_write.  Input buffers that can't be moved as a whole
+ * (len limit hit, or buffer exceeds the frame limit) are copied. */
+ssize_t
+pipe_framed_splice(struct proxy_ctx *ctx, struct pipe_inode_info *ipipe,
+                   struct proxy_target *t, size_t len, unsigned int flags)
+{
+	struct pipe_inode_info *opipe = t->file->private_data;
+	bool input_wakeup = false, wake;
+	ssize_t ret = 0;
+
+	if (ipipe == opipe)
+		return -EINVAL;
+
+	/* same as pipe_framed_write, and do_splice between pipes */
+	if (t->file->f_flags & O_NONBLOCK)
+		flags |= SPLICE_F_NONBLOCK;
+
+	/* PERCPU: frames the proxy staged go first */
+	if (ctx->mode & PROXYFD_MODE_PERCPU) {
+		ret = stage_flush_last(t, flags & SPLICE_F_NONBLOCK);
+		if (ret == -EPIPE)
+			send_sig(SIGPIPE, current, 0);
+		if (ret)
+			return ret;
+	}
+
+retry:
+	ret = ipipe_prep(ipipe, flags);
+	if (ret)
+		return ret;
+
+	ret = opipe_prep(opipe, flags);
+	if (ret)
+		return ret;
+
+	framed_double_lock(ipipe, opipe);
+
+	do {
+		size_t limit = min(len, fhdr_frame_max(ctx));
+		size_t chars = 0;
+		int free, n, err;
+
+		if (!opipe->readers) {
+			send_sig(SIGPIPE, current, 0);
+			if (!ret)
+				ret = -EPIPE;
+			break;
+		}
+
+		if (!ring_nrbufs(ipipe) && !ipipe->writers)
+			break;
+
+		/*
+		 * Cannot make any progress, because either the input
+		 * pipe is empty or the output pipe is full.
+		 */
+		if (!ring_nrbufs(ipipe) || ring_full(opipe)) {
+			/* Already processed some buffers, break */
+			if (ret)
+				break;
+
+			if (flags & SPLICE_F_NONBLOCK) {
+				proxy_stat_add(ctx, PROXY_STAT_EAGAIN, 1);
+				ret = -EAGAIN;
+				break;
+			}
+
+			/*
+			 * We raced with another reader/writer and haven't
+			 * managed to process any buffers.  A zero return
+			 * value means EOF, so retry instead.
+			 */
+			pipe_unlock(ipipe);
+			pipe_unlock(opipe);
+			goto retry;
+		}
+
+		/* Slots left for data once the header is placed. */
+		free = ring_maxbufs(opipe) - ring_nrbufs(opipe) -
+		       !pipe_header_merges(opipe, fhdr_size(ctx));
+
+		for (n = 0; n < free && n < ring_nrbufs(ipipe); n++) {
+			struct pipe_buffer *ibuf = ring_buf(ipipe, n);
+
+			if (chars + ibuf->len > limit)
+				break;
+			chars += ibuf->len;
+		}
+
+		if (!n) {
+			/* No room for a separate header, or the head
+			 * buffer is too large to move. */
+			if (ret && free < 1)
+				break;
+			chars = min_t(size_t, limit, PAGE_SIZE - fhdr_size(ctx));
+			chars = min_t(size_t, chars, ring_buf(ipipe, 0)->len);
+			err = pipe_framed_copy(ctx, t->fp, ipipe, opipe, chars);
+			if (err) {
+				if (!ret)
+					ret = err;
+				break;
+			}
+		} else if (!chars) {
+			/* Empty buffers only, nothing to frame. */
+			while (n--)
+				ipipe_consume(ipipe, ring_buf(ipipe, 0));
+		} else {
+			struct fhdr h;
+
+			fhdr_make(ctx, t->fp, &h, chars, false);
+			err = pipe_put_header(ctx, t->fp, &h);
+			if (err) {
+				fhdr_drop(ctx, t->fp);
+				if (!ret)
+					ret = err;
+				break;
+			}
+			while (n--) {
+				struct pipe_buffer *ibuf = ring_buf(ipipe, 0);
+
+				/* Simply move the whole buffer */
+				*ring_head(opipe) = *ibuf;
+				ring_push(opipe);
+				ibuf->ops = NULL;
+				ipipe_consume(ipipe, ibuf);
+			}
+		}
+		input_wakeup = true;
+		if (chars)
+			proxy_stat_add(ctx, PROXY_STAT_FRAMES, 1);
+
+		ret += chars;
+		len -= chars;
+	} while (len);
+
+	wake = ret > 0 && framed_wake_now(t->fp, ret);
+	pipe_unlock(ipipe);
+	pipe_unlock(opipe);
+
+	/*
+	 * If we put data in the output pipe, wakeup any potential readers.
+	 */
+	if (ret > 0)
+		proxy_stat_add(ctx, PROXY_STAT_BYTES, ret);
+	if (wake)
+		ring_wake_readers(opipe);
+
+	if (input_wakeup)
+		ring_wake_writers(ipipe);
+
+	return ret;
+}
+
+/* Fan-out: a record is copied once into pages of its own, every pipe
+ * gets a header and references to the same pages.  Shared pages are
+ * never merged into (see pipe_buf_can_merge).  Records are limited to
+ * TEE_PAGES, the default pipe size. */
+#define TEE_PAGES 16
+
+/* Frame of len bytes in shared pages, pipe locked and room checked. */
+static int tee_put(struct proxy_ctx *ctx, struct proxy_target *t,
+                   struct page **pages, unsigned int npages, size_t len)
+{
+	struct pipe_inode_info *pipe = t->file->private_data;
+	struct fhdr h;
+	unsigned int i;
+	int err;
+
+	fhdr_make(ctx, t->fp, &h, len, false);
+	err = pipe_put_header(ctx, t->fp, &h);
+	if (err) {
+		fhdr_drop(ctx, t->fp);
+		return err;
+	}
+	for (i = 0; i < npages; i++) {
+		struct pipe_buffer *buf = ring_head(pipe);
+
+		get_page(pages[i]);
+		buf->page = pages[i];
+		buf->ops = &anon_pipe_buf_ops;
+		buf->offset = 0;
+		buf->len = min_t(size_t, len - i * PAGE_SIZE, PAGE_SIZE);
+		buf->flags = 0;
+		buf_charge(t->fp->pool, NULL, buf);
+		ring_push(pipe);
+	}
+	proxy_stat_add(ctx, PROXY_STAT_NEWBUFS, npages);
+	proxy_stat_add(ctx, PROXY_STAT_FRAMES, 1);
+	return 0;
+}
+
+/* Insert the frame into a single pipe of the fan-out, waiting for room
+ * unless nonblock.  Returns 0 or an error, no signals sent. */
+static int tee_write(struct proxy_ctx *ctx, struct proxy_target *t,
+                     struct page **pages, unsigned int npages, size_t len,
+                     bool nonblock, bool nowait)
+{
+	struct pipe_inode_info *pipe = t->file->private_data;
+	bool wake_next_writer = false, wake;
+	unsigned int nbufs;
+	u64 wait_start;
+	int ret;
+
+	if (nowait) {
+		if (!mutex_trylock(&pipe->mutex))
+			return -EAGAIN;
+	} else {
+		__pipe_lock(pipe);
+	}
+
+	for (;;) {
+		if (!pipe->readers) {
+			ret = -EPIPE;
+			goto out;
+		}
+		nbufs = npages + !pipe_header_merges(pipe, fhdr_size(ctx));
+		if (nbufs > ring_maxbufs(pipe)) {
+			ret = -EMSGSIZE;
+			goto out;
+		}
+		if (ring_nrbufs(pipe) + nbufs <= ring_maxbufs(pipe))
+			break;
+		if (nonblock) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		wait_start = ktime_get_ns();
+		wake_next_writer = ring_wait_room(pipe, nbufs, true);
+		proxy_stat_add(ctx, PROXY_STAT_WAIT_NS,
+		               ktime_get_ns() - wait_start);
+	}
+	ret = tee_put(ctx, t, pages, npages, len);
+
+out:
+	if (ring_full(pipe))
+		wake_next_writer = false;
+	wake = !ret && framed_wake_now(t->fp, len);
+	__pipe_unlock(pipe);
+	if (wake)
+		ring_wake_readers(pipe);
+	if (wake_next_writer)
+		ring_wake_writers(pipe);
+	return ret;
+}
+
+/* PROXYFD_SHARD_TEE: the record goes to every pipe.  The first pipe
+ * decides the outcome of the write; the others wait for room too, or
+ * drop the frame with PROXYFD_MODE_TEE_DROP (and for non-blocking
+ * writers). */
+ssize_t pipe_framed_tee(struct proxy_ctx *ctx, struct proxy_targets *ts,
+                        struct kiocb *iocb, struct iov_iter *from)
+{
+	bool nowait = iocb_nowait(iocb);
+	bool nonblock = nowait || (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	                (ts->t[0].file->f_flags & O_NONBLOCK);
+	bool drop = ctx->mode & PROXYFD_MODE_TEE_DROP;
+	bool atomic = ctx->mode & PROXYFD_MODE_ATOMIC;
+	size_t limit = min_t(size_t, fhdr_frame_max(ctx),
+	                     TEE_PAGES * PAGE_SIZE);
+	size_t len = iov_iter_count(from);
+	struct page *pages[TEE_PAGES];
+	unsigned int npages = 0, maxbufs, i;
+	size_t copied = 0;
+	ssize_t ret, err = 0;
+
+	/* Null write succeeds. */
+	if (unlikely(len == 0))
+		return 0;
+
+	if (atomic && (len > limit ||
+	               (ctx->max_atomic && len > ctx->max_atomic)))
+		return -EMSGSIZE;
+	len = min(len, limit);
+	/* what the primary can take, the header in a buffer of its own;
+	 * only atomic writes get EMSGSIZE from tee_write */
+	maxbufs = ring_maxbufs(ts->t[0].fp->pipe);
+	if (!atomic && maxbufs > 1)
+		len = min_t(size_t, len, (size_t)(maxbufs - 1) * PAGE_SIZE);
+
+	/* may fault, no locks held */
+	while (copied < len) {
+		size_t chars = min_t(size_t, len - copied, PAGE_SIZE);
+		struct page *page;
+		size_t n;
+		char *kaddr;
+
+		page = pool_alloc_page(ts->t[0].fp, ctx);
+		if (unlikely(!page)) {
+			err = -ENOMEM;
+			break;
+		}
+		pages[npages++] = page;
+		kaddr = kmap(page);
+		n = copy_from_iter(kaddr, chars, from);
+		kunmap(page);
+		copied += n;
+		if (unlikely(n < chars)) {
+			err = -EFAULT;
+			break;
+		}
+	}
+	if (err) {
+		ret = err;
+		if (!copied || atomic)
+			goto out_revert;
+		/* short write, as a fault or allocation failure in
+		 * pipe_framed_write would make it */
+		len = copied;
+		if (DIV_ROUND_UP(len, PAGE_SIZE) < npages)
+			pool_put_page(ts->t[0].fp->pool, pages[--npages]);
+	}
+
+	ret = tee_write(ctx, &ts->t[0], pages, npages, len, nonblock, nowait);
+	if (ret) {
+		if (ret == -EPIPE)
+			send_sig(SIGPIPE, current, 0);
+		else if (ret == -EAGAIN)
+			proxy_stat_add(ctx, PROXY_STAT_EAGAIN, 1);
+		goto out_revert;
+	}
+
+	for (i = 1; i < ts->n; i++) {
+		if (tee_write(ctx, &ts->t[i], pages, npages, len,
+		              nonblock || drop, nowait))
+			proxy_stat_add(ctx, PROXY_STAT_DROPPED, 1);
+	}
+
+	proxy_stat_add(ctx, PROXY_STAT_BYTES, len);
+	ret = len;
+	if (sb_start_write_trylock(file_inode(ts->t[0].file)->i_sb)) {
+		err = file_update_time(ts->t[0].file);
+		if (err)
+			ret = err;
+		sb_end_write(file_inode(ts->t[0].file)->i_sb);
+	}
+	goto out;
+
+out_revert:
+	iov_iter_revert(from, copied);
+out:
+	for (i = 0; i < npages; i++)
+		pool_put_page(ts->t[0].fp->pool, pages[i]);
+	return ret;
+}
+
+/* Reader side, PROXYFD_IOC_RECV: whole frames are parsed out of the
+ * pipe, payloads copied to the caller back to back.  Nothing is consumed
+ * until the batch is complete, a failed copy leaves the pipe as is. */
+struct recv_pos {
+	unsigned int i;    /* buffer, from the oldest one */
+	size_t       off;  /* bytes into it */
+};
+
+/* Copy n bytes at pos (to user memory if udst, else to dst), advancing
+ * pos.  Returns 0, -ENODATA if the pipe holds fewer bytes, or an error. */
+static int recv_copy(struct pipe_inode_info *pipe, struct recv_pos *pos,
+                     void *dst, char __user *udst, size_t n)
+{
+	while (n) {
+		struct pipe_buffer *buf;
+		size_t chars;
+		char *kaddr;
+		int err;
+
+		if (pos->i >= ring_nrbufs(pipe))
+			return -ENODATA;
+		buf = ring_buf(pipe, pos->i);
+		if (pos->off == buf->len) {
+			pos->i++;
+			pos->off = 0;
+			continue;
+		}
+		err = pipe_buf_confirm(pipe, buf);
+		if (err)
+			return err;
+
+		chars = min_t(size_t, n, buf->len - pos->off);
+		kaddr = kmap(buf->page) + buf->offset + pos->off;
+		if (udst) {
+			err = copy_to_user(udst, kaddr, chars) ? -EFAULT : 0;
+			udst += chars;
+		} else {
+			memcpy(dst, kaddr, chars);
+			dst += chars;
+		}
+		kunmap(buf->page);
+		if (err)
+			return err;
+		pos->off += chars;
+		n -= chars;
+	}
+	return 0;
+}
+
+/* Parse a header at pos into f.  Returns 0, -ENODATA or an error. */
+static int recv_header(struct pipe_inode_info *pipe, struct recv_pos *pos,
+                       __u32 hdr, struct proxyfd_frame *f)
+{
+	struct fhdr h;
+	int err;
+
+	memset(f, 0, sizeof(*f));
+	if (hdr == PROXYFD_HDR_V0) {
+		err = recv_copy(pipe, pos, &h.v0, NULL, HDR);
+		if (err)
+			return err;
+		f->cookie = h.v0 & ~htonl(0xffff);
+		f->len = ntohl(h.v0) & 0xffff;
+		return 0;
+	}
+
+	err = recv_copy(pipe, pos, &h.v1, NULL, sizeof(h.v1));
+	if (err)
+		return err;
+	if (PROXYFD_HDR_VERSION(be32_to_cpu(h.v1.info)) != PROXYFD_HDR_V1)
+		return -EBADMSG;
+	f->len = be32_to_cpu(h.v1.len);
+	f->info = be32_to_cpu(h.v1.info) & 0xffffff;
+	f->stream = be64_to_cpu(h.v1.stream);
+	if (f->info & PROXYFD_HDR_TS) {
+		err = recv_copy(pipe, pos, &h.ts, NULL, sizeof(h.ts));
+		if (err)
+			return err;
+		f->ts = be64_to_cpu(h.ts.ts);
+		f->seq = be64_to_cpu(h.ts.seq);
+	}
+	return 0;
+}
+
+/* Drop the bytes up to pos, the batch was taken.
+ * Returns the number of buffers freed. */
+static unsigned int recv_consume(struct pipe_inode_info *pipe,
+                                 const struct recv_pos *pos)
+{
+	struct pipe_buffer *buf;
+	unsigned int i;
+
+	for (i = 0; i < pos->i; i++) {
+		pipe_buf_release(pipe, ring_buf(pipe, 0));
+		ring_pop(pipe);
+	}
+	if (!ring_nrbufs(pipe))
+		return i;
+
+	buf = ring_buf(pipe, 0);
+	buf->offset += pos->off;
+	buf->len -= pos->off;
+	if (!buf->len) {
+		pipe_buf_release(pipe, buf);
+		ring_pop(pipe);
+		i++;
+	}
+	return i;
+}
+
+/* Returns the number of frames (0: no writers left), r->nframes and
+ * r->buflen are updated. */
+long pipe_framed_recv(struct file *filp, struct proxyfd_recv *r)
+{
+	struct pipe_inode_info *pipe = filp->private_data;
+	struct proxyfd_frame __user *uframes = u64_to_user_ptr(r->frames);
+	char __user *ubuf = u64_to_user_ptr(r->buf);
+	bool nonblock = (filp->f_flags & O_NONBLOCK) ||
+	                (r->flags & PROXYFD_RECV_NONBLOCK);
+	struct recv_pos pos = {};
+	__u32 n = 0, used = 0;
+	unsigned int freed = 0;
+	long ret = 0;
+
+	pipe_lock(pipe);
+	while (!ring_nrbufs(pipe)) {
+		if (!pipe->writers)
+			goto out;
+		if (nonblock) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		ring_wait_readable(pipe);
+	}
+
+	while (n < r->nframes) {
+		struct recv_pos start = pos;
+		struct proxyfd_frame f;
+
+		ret = recv_header(pipe, &pos, r->hdr, &f);
+		if (!ret && f.len > r->buflen - used)
+			ret = -EMSGSIZE;
+		if (!ret) {
+			f.offset = used;
+			ret = recv_copy(pipe, &pos, NULL, ubuf + used, f.len);
+		}
+		if (!ret && copy_to_user(uframes + n, &f, sizeof(f)))
+			ret = -EFAULT;
+		if (ret) {
+			pos = start;
+			break;
+		}
+		used += f.len;
+		n++;
+	}
+	/* data left: frames that don't fit are for the next call; a lone
+	 * partial frame means the pipe isn't framed as told */
+	if (ret == -ENODATA)
+		ret = n ? 0 : -EBADMSG;
+	else if (ret == -EMSGSIZE && n)
+		ret = 0;
+	if (ret)
+		goto out;
+
+	freed = recv_consume(pipe, &pos);
+	ret = n;
+out:
+	pipe_unlock(pipe);
+	if (freed)
+		ring_wake_writers(pipe);
+	if (ret < 0)
+		return ret;
+	if (ret > 0)
+		file_accessed(filp);
+	r->nframes = n;
+	r->buflen = used;
+	return ret;
+}
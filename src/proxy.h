@@ -0,0 +1,174 @@
+/* proxyfd kernel module - internals shared between source files */
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/refcount.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+
+#include "proxyfd.h"
+
+struct file;
+struct kiocb;
+struct iov_iter;
+struct pipe_inode_info;
+struct framed_pipe;
+struct framed_share;
+struct proxy_ring;
+
+/* Counters, kept per proxy and module-wide. */
+enum {
+	PROXY_STAT_BYTES,
+	PROXY_STAT_FRAMES,
+	PROXY_STAT_MERGED,  /* frames appended to the last pipe buffer */
+	PROXY_STAT_NEWBUFS, /* pipe buffers added */
+	PROXY_STAT_EAGAIN,  /* non-blocking writes that hit a full pipe */
+	PROXY_STAT_WAIT_NS, /* time spent waiting for room in the pipe */
+	PROXY_STAT_DROPPED, /* writes over the share, fan-out frames a
+	                     * secondary pipe didn't get */
+	PROXY_STAT_RECYCLED, /* pages taken from the pool */
+	PROXY_STAT_NR
+};
+
+struct proxy_stats {
+	atomic64_t v[PROXY_STAT_NR];
+};
+
+struct proxy_global_stats {
+	u64 v[PROXY_STAT_NR];
+};
+
+DECLARE_PER_CPU(struct proxy_global_stats, proxy_global_stats);
+
+/* Teardown that may wait, off the closing task; drained on unload. */
+extern struct workqueue_struct *proxy_wq;
+
+#define PROXYFD_MODE_MASK \
+	(PROXYFD_MODE_IOVEC | PROXYFD_MODE_ATOMIC | PROXYFD_MODE_PACKED | \
+	 PROXYFD_MODE_TS | PROXYFD_MODE_PERCPU | PROXYFD_MODE_TEE_DROP | \
+	 PROXYFD_MODE_FAIR_DROP | PROXYFD_MODE_ZEROCOPY | \
+	 PROXYFD_MODE_LARGEBUF)
+
+/* A pipe or a ring the proxy writes to. */
+struct proxy_target {
+	struct file        *file;
+	wait_queue_head_t  *wq;      /* where writers wait for room */
+	struct wait_queue_entry wait; /* on wq while polled, wakes the proxy */
+	struct framed_pipe *fp;      /* state shared by proxies of the pipe */
+	struct proxy_ring  *ring;    /* target is a ring rather than a pipe */
+	struct framed_share *share;  /* weighted: buffers held in the pipe */
+	int                 stage_cpu;  /* PERCPU: stage last written, -1 */
+	unsigned long       stage_gen;  /* its generation back then */
+};
+
+/* Set of targets, swapped as a whole on retargeting. */
+struct proxy_targets {
+	refcount_t          ref;     /* ctx, operations in progress */
+	unsigned int        n;
+	struct proxy_target t[];
+};
+
+struct proxy_ctx {
+	struct proxy_targets __rcu *targets;
+	struct mutex        retarget_lock;
+	wait_queue_head_t   wait;    /* pollers */
+	__u32               shard;   /* PROXYFD_SHARD_*, if several targets */
+	atomic_t            rr;
+	__u32               cookie;
+	__u32               mode;
+	__u32               max_atomic;
+	__u32               hdr;     /* PROXYFD_HDR_* */
+	__u64               stream;
+	__u32               weight;  /* share of pipe buffers, 0: any */
+	__u32               lowat;   /* poll threshold, bytes */
+	struct proxy_stats  stats;
+};
+
+static inline void proxy_stat_add(struct proxy_ctx *ctx, int stat, u64 v)
+{
+	atomic64_add(v, &ctx->stats.v[stat]);
+	this_cpu_add(proxy_global_stats.v[stat], v);
+}
+
+/* V0 header */
+#define HDR 4
+
+/* Frames may span several buffers; with V0 headers the length is still
+ * limited to 16 bits, since readers mask the cookie out with 0xffff. */
+#define FRAME_MAX 0xffff
+
+/* Frame header in the proxy's format, see PROXYFD_HDR_*. */
+struct fhdr {
+	union {
+		__u32                 v0;
+		struct {
+			struct proxyfd_hdr_v1 v1;
+			struct proxyfd_hdr_ts ts;
+		};
+	};
+	unsigned int size;
+};
+
+static inline size_t fhdr_size(const struct proxy_ctx *ctx)
+{
+	if (ctx->hdr != PROXYFD_HDR_V1)
+		return HDR;
+	if (ctx->mode & PROXYFD_MODE_TS)
+		return sizeof(struct proxyfd_hdr_v1) +
+		       sizeof(struct proxyfd_hdr_ts);
+	return sizeof(struct proxyfd_hdr_v1);
+}
+
+/* Longest frame the format allows. */
+static inline size_t fhdr_frame_max(const struct proxy_ctx *ctx)
+{
+	return ctx->hdr == PROXYFD_HDR_V1 ? (size_t)U32_MAX : FRAME_MAX;
+}
+
+static inline bool iocb_nowait(const struct kiocb *iocb)
+{
+#ifdef IOCB_NOWAIT
+	return iocb->ki_flags & IOCB_NOWAIT;
+#else
+	return false;
+#endif
+}
+
+/* pipe.c */
+void fhdr_make(const struct proxy_ctx *ctx, struct framed_pipe *fp,
+               struct fhdr *h, size_t chars, bool more);
+bool pipe_framed_supported(struct file *filp);
+int pipe_framed_attach(struct proxy_ctx *ctx, struct proxy_target *t);
+void pipe_framed_detach(struct proxy_target *t);
+u64 pipe_framed_seq(struct proxy_target *t);
+int pipe_framed_set_wakeup(struct proxy_target *t,
+                           const struct proxyfd_wakeup *w);
+void pipe_framed_flush(struct proxy_target *t);
+size_t pipe_framed_lowat_max(struct proxy_ctx *ctx);
+wait_queue_head_t *pipe_framed_waitq(struct proxy_target *t);
+__poll_t pipe_framed_poll(struct proxy_ctx *ctx, struct proxy_target *t);
+ssize_t pipe_framed_write(struct proxy_ctx *ctx, struct proxy_target *t,
+                          struct kiocb *iocb, struct iov_iter *from);
+ssize_t pipe_framed_splice(struct proxy_ctx *ctx,
+                           struct pipe_inode_info *ipipe,
+                           struct proxy_target *t,
+                           size_t len, unsigned int flags);
+ssize_t pipe_framed_tee(struct proxy_ctx *ctx, struct proxy_targets *ts,
+                        struct kiocb *iocb, struct iov_iter *from);
+long pipe_framed_recv(struct file *filp, struct proxyfd_recv *r);
+
+/* ring.c */
+bool ring_file(struct file *filp);
+int ring_create(const struct proxyfd_ring_req *r);
+wait_queue_head_t *ring_waitq(struct proxy_ring *ring);
+size_t ring_framed_lowat_max(struct proxy_ctx *ctx, struct proxy_target *t);
+__poll_t ring_framed_poll(struct proxy_ctx *ctx, struct proxy_target *t);
+ssize_t ring_framed_write(struct proxy_ctx *ctx, struct proxy_target *t,
+                          struct kiocb *iocb, struct iov_iter *from);
+
+#endif
@@ -0,0 +1,286 @@
+/* proxyfd kernel module - userspace interface
+ *
+ * Shared by the module and userspace programs.
+ */
+#ifndef PROXYFD_H
+#define PROXYFD_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define PROXYFD_DEV_PATH "/dev/proxyfd"
+
+/* Single proxy request; write() it into the device, the result is
+ * either an error or a new (proxy) file descriptor. */
+struct proxy_req {
+	__u32 flags; /* O_CLOEXEC, O_NONBLOCK */
+	__u32 cookie;
+	__u32 pipefd;
+};
+
+/* Extended proxy request, used with PROXYFD_IOC_CREATE.
+ * New fields are only ever appended; callers pass the size of the
+ * structure they were built with in proxyfd_batch.size. */
+struct proxyfd_req {
+	__u32 flags;    /* O_CLOEXEC, O_NONBLOCK */
+	__u32 cookie;
+	__u32 pipefd;
+	__u32 pad;      /* must be 0 */
+	__s32 result;   /* out: proxy fd or -errno */
+	__u32 mode;     /* PROXYFD_MODE_* */
+	__u32 max_atomic; /* PROXYFD_MODE_ATOMIC: largest write, 0: pipe size */
+	__u32 hdr;      /* PROXYFD_HDR_* */
+	__u64 stream;   /* PROXYFD_HDR_V1: stream id */
+	__u32 shard;    /* PROXYFD_SHARD_*, with npipes */
+	__u32 npipes;   /* >0: write to pipefds rather than pipefd */
+	__u64 pipefds;  /* __s32[npipes], pipes or rings */
+	__u32 weight;   /* share of the pipe's buffers, 0: unlimited */
+	__u32 reserved; /* must be 0 */
+};
+
+#define PROXYFD_REQ_SIZE_VER0 20
+
+/* Sharded proxies: each write (a record, or a group with
+ * PROXYFD_MODE_IOVEC) goes to one of the pipes, picked
+ *
+ * RR:   in turn;
+ * CPU:  by the CPU the writer runs on;
+ * HASH: by cookie and stream, i.e. always the same one; proxies sharing
+ *       a set of pipes are spread over them.
+ *
+ * Frames of a proxy keep their order only within a pipe.
+ *
+ * TEE is fan-out rather than sharding: every record goes to all the
+ * pipes, which share the pages holding it.  The first pipe is the
+ * primary, the result of a write is that of the primary.  The others
+ * are waited for as well, unless PROXYFD_MODE_TEE_DROP is set or the
+ * writer is non-blocking: then frames they have no room for are
+ * dropped.  Records are limited to 16 pages, pipes only; not with
+ * IOVEC, PERCPU or PACKED. */
+#define PROXYFD_SHARD_RR   0
+#define PROXYFD_SHARD_CPU  1
+#define PROXYFD_SHARD_HASH 2
+#define PROXYFD_SHARD_TEE  3
+
+#define PROXYFD_PIPES_MAX 64
+
+/* Weighted proxies hold at most weight / (sum of the weights of the
+ * weighted proxies writing there) of the pipe's buffers, one at least.
+ * Frames appended to the last buffer don't count.  Unweighted proxies
+ * are not limited, nor do they take part in the sum.  Writers over their
+ * share wait (or get EAGAIN) as if the pipe were full, see also
+ * PROXYFD_MODE_FAIR_DROP.  Not with PERCPU, fan-out or rings. */
+#define PROXYFD_WEIGHT_MAX 1024
+
+/* writev() makes a record per iovec, the group is inserted atomically
+ * if it fits in the pipe */
+#define PROXYFD_MODE_IOVEC 0x1
+
+/* A write goes in whole or not at all: non-blocking writers get EAGAIN
+ * instead of a partial count, writes that can never fit get EMSGSIZE */
+#define PROXYFD_MODE_ATOMIC 0x2
+
+/* Frames fill pipe buffers up, spanning buffer boundaries (header
+ * included) rather than starting a fresh page when the tail is short */
+#define PROXYFD_MODE_PACKED 0x4
+
+/* V1 headers are followed by struct proxyfd_hdr_ts, frames are stamped
+ * when inserted into the pipe */
+#define PROXYFD_MODE_TS 0x8
+
+/* Frames are staged in a per-CPU page and moved into the pipe a page at
+ * a time, later on or when the page fills up; no pipe lock on the fast
+ * path.  Frames of a proxy keep their order.  Records must fit in a
+ * page to be staged, larger ones are written directly.  Not combined
+ * with IOVEC, ATOMIC or TS */
+#define PROXYFD_MODE_PERCPU 0x10
+
+/* Fan-out (PROXYFD_SHARD_TEE): a pipe other than the first one that has
+ * no room for the frame right away doesn't get it, rather than holding
+ * the writer up */
+#define PROXYFD_MODE_TEE_DROP 0x20
+
+/* Weighted proxies: a write, or the rest of one, the proxy's share of
+ * the pipe has no room for is dropped (and reported as written) rather
+ * than waited for */
+#define PROXYFD_MODE_FAIR_DROP 0x40
+
+/* Writes of PROXYFD_ZEROCOPY_MIN bytes or more from user memory put the
+ * writer's pages themselves into the pipe, behind the headers, rather
+ * than copies; as vmsplice with SPLICE_F_GIFT, the writer must leave the
+ * buffer alone until the frames are read, or readers see the changes.
+ * Frames take 16 pages at most.  Smaller writes, splice and writes
+ * from kernel memory copy as usual.  Not with IOVEC, ATOMIC, fan-out,
+ * weights or rings */
+#define PROXYFD_MODE_ZEROCOPY 0x80
+
+#define PROXYFD_ZEROCOPY_MIN 65536
+
+/* Frames go into buffers of PROXYFD_LARGEBUF_SIZE bytes (compound
+ * pages) rather than a page, fewer headers and buffers per MB; a frame
+ * spans a single buffer at most, records are split as with V1.  Falls
+ * back to pages when memory is fragmented.  A pipe holds as many
+ * buffers as before, thus that much more data.  Not with ATOMIC,
+ * PERCPU, fan-out or rings */
+#define PROXYFD_MODE_LARGEBUF 0x100
+
+#define PROXYFD_LARGEBUF_SIZE 65536
+
+/* Frame header formats.
+ *
+ * V0: BE __u32, frame length OR-d with the cookie; frames are limited
+ *     to 0xffff bytes, readers mask the cookie out.
+ *
+ * V1: struct proxyfd_hdr_v1, full 32-bit length and a 64-bit stream id
+ *     (cookie must be 0).  A record is a single frame if it fits in the
+ *     pipe, the writer waits for room for it (non-blocking writers put in
+ *     what fits now); otherwise it is split and every frame but the last
+ *     one has PROXYFD_HDR_MORE set.  Frames of different streams may come
+ *     in between.
+ *
+ * Framing is per proxy; readers must know what to expect, proxies
+ * sharing a pipe should agree on the format. */
+#define PROXYFD_HDR_V0 0
+#define PROXYFD_HDR_V1 1
+
+struct proxyfd_hdr_v1 {
+	__be32 len;
+	__be32 info;    /* version << 24 | PROXYFD_HDR_* flags */
+	__be64 stream;
+};
+
+/* Present if PROXYFD_HDR_TS is set in info. */
+struct proxyfd_hdr_ts {
+	__be64 ts;      /* CLOCK_MONOTONIC, ns */
+	__be64 seq;     /* per pipe, shared by all proxies writing there */
+};
+
+#define PROXYFD_HDR_VERSION(info) ((info) >> 24)
+#define PROXYFD_HDR_MORE 0x1  /* record continues in a later frame */
+#define PROXYFD_HDR_TS   0x2  /* struct proxyfd_hdr_ts follows */
+
+/* Batch of requests, each entry gets its own result. */
+struct proxyfd_batch {
+	__u32 count;
+	__u32 size;     /* sizeof(struct proxyfd_req) */
+	__u64 reqs;     /* struct proxyfd_req[count] */
+};
+
+#define PROXYFD_BATCH_MAX 1024
+
+/* Ring: an alternative to pipes as the target of proxies.  The reader
+ * mmaps it (MAP_SHARED, offset 0, PROXYFD_RING_MMAP_SIZE bytes): the
+ * control page, followed by the data area mapped twice in a row, so that
+ * a frame wrapping around the end is contiguous nonetheless.
+ *
+ * Frames are laid out back to back, headers as with pipes.  The kernel
+ * advances head once a write is complete, a write goes in whole or not
+ * at all.  The reader consumes from data[tail % size] and advances tail.
+ * If PROXYFD_RING_NEED_WAKEUP is set after that, writers wait for room:
+ * wake them with PROXYFD_IOC_RING_WAKE on the ring (polling it does
+ * too).  Once the last mapping is gone, writes fail with EPIPE and
+ * proxies poll EPOLLERR | EPOLLHUP.
+ *
+ * The ring polls readable while head != tail.  The optional eventfd is
+ * signalled when a write finds the ring drained; re-check head after
+ * updating tail, before blocking on it. */
+struct proxyfd_ring_ctl {
+	__u64 head;     /* kernel: bytes produced */
+	__u64 tail;     /* reader: bytes consumed */
+	__u32 size;     /* data area, bytes */
+	__u32 flags;    /* PROXYFD_RING_* */
+};
+
+#define PROXYFD_RING_NEED_WAKEUP 0x1
+
+/* size is a power of 2, a page at least, up to PROXYFD_RING_SIZE_MAX */
+struct proxyfd_ring_req {
+	__u32 size;
+	__u32 flags;    /* O_CLOEXEC */
+	__s32 eventfd;  /* -1: none */
+	__u32 pad;
+};
+
+#define PROXYFD_RING_SIZE_MAX (64u << 20)
+#define PROXYFD_RING_MMAP_SIZE(size, page) ((page) + 2 * (size_t)(size))
+
+#define PROXYFD_IOC_MAGIC  0xE7
+
+/* Control device: returns the number of proxies created. */
+#define PROXYFD_IOC_CREATE _IOW(PROXYFD_IOC_MAGIC, 1, struct proxyfd_batch)
+
+/* Proxy: poll() reports EPOLLOUT only if a frame carrying that many
+ * bytes fits, up to a page minus header; 0 means any room in the pipe */
+#define PROXYFD_IOC_SET_LOWAT _IOW(PROXYFD_IOC_MAGIC, 2, __u32)
+
+/* Reader wakeup policy of the pipe, shared by all proxies writing
+ * there.  Readers are woken once bytes are queued (0: no threshold), or
+ * delay_us after the first frame at the latest, or at once if the pipe
+ * gets full.  delay_us 0 turns deferral off (the default). */
+struct proxyfd_wakeup {
+	__u32 bytes;
+	__u32 delay_us; /* up to 1s */
+};
+
+#define PROXYFD_WAKEUP_DELAY_MAX 1000000
+
+/* Proxy: set the wakeup policy of the pipe */
+#define PROXYFD_IOC_SET_WAKEUP _IOW(PROXYFD_IOC_MAGIC, 3, struct proxyfd_wakeup)
+
+/* Proxy: wake the pipe's readers now if wakeups are pending */
+#define PROXYFD_IOC_FLUSH _IO(PROXYFD_IOC_MAGIC, 4)
+
+/* Control device: create a ring, returns its fd; pass it as pipefd to
+ * create proxies writing there */
+#define PROXYFD_IOC_RING_CREATE _IOW(PROXYFD_IOC_MAGIC, 5, struct proxyfd_ring_req)
+
+/* Ring: wake writers waiting for room */
+#define PROXYFD_IOC_RING_WAKE _IO(PROXYFD_IOC_MAGIC, 6)
+
+/* New targets for a proxy, as in struct proxyfd_req */
+struct proxyfd_retarget {
+	__s32 pipefd;
+	__u32 npipes;   /* >0: pipefds rather than pipefd */
+	__u64 pipefds;  /* __s32[npipes] */
+};
+
+/* Proxy: switch to other pipes (or rings).  Writes issued afterwards go
+ * there; writes in progress complete on the old targets, whole, which
+ * are let go once they're done.  The proxy's settings stay, the new
+ * targets must suit them as on creation. */
+#define PROXYFD_IOC_RETARGET _IOW(PROXYFD_IOC_MAGIC, 7, struct proxyfd_retarget)
+
+/* Frame as returned by PROXYFD_IOC_RECV. */
+struct proxyfd_frame {
+	__u32 cookie;   /* V0: the header, length masked out */
+	__u32 len;      /* payload bytes */
+	__u32 offset;   /* of the payload in proxyfd_recv.buf */
+	__u32 info;     /* V1: PROXYFD_HDR_* flags */
+	__u64 stream;   /* V1 */
+	__u64 ts;       /* PROXYFD_HDR_TS: struct proxyfd_hdr_ts, host order */
+	__u64 seq;
+};
+
+/* Batch of frames to read from a pipe fed by proxies. */
+struct proxyfd_recv {
+	__s32 pipefd;   /* read end */
+	__u32 hdr;      /* PROXYFD_HDR_* the proxies of the pipe use */
+	__u64 frames;   /* struct proxyfd_frame[nframes] */
+	__u64 buf;      /* payloads, back to back */
+	__u32 nframes;  /* in: room, out: frames returned */
+	__u32 buflen;   /* in: bytes, out: bytes used */
+	__u32 flags;    /* PROXYFD_RECV_* */
+	__u32 pad;
+};
+
+#define PROXYFD_RECV_NONBLOCK 0x1
+
+/* Control device: read whole frames off a pipe, as many as fit, headers
+ * parsed.  Returns the number of frames, 0 once the pipe is empty and
+ * has no writers; waits for data unless non-blocking (either flag or the
+ * pipe's O_NONBLOCK).  EMSGSIZE: the first frame doesn't fit in buf.
+ * EBADMSG: the data isn't framed as hdr says.  Frames of a V1 record
+ * split in several come one by one, with PROXYFD_HDR_MORE. */
+#define PROXYFD_IOC_RECV _IOWR(PROXYFD_IOC_MAGIC, 8, struct proxyfd_recv)
+
+#endif
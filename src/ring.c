@@ -0,0 +1,464 @@
+/* proxyfd kernel module
+ *
+ * Ring target: a kernel-managed buffer the reader mmaps, see
+ * struct proxyfd_ring_ctl.  Proxies write framed records straight into
+ * the mapping, the reader consumes them without any syscalls.
+ *
+ * Data pages are vmap-ed twice in a row, same as they are mapped to the
+ * reader, so a frame wrapping around the end is copied in one go.
+ *
+ * Reader and writers share the control page.  The kernel keeps its own
+ * copy of head, tail comes from the reader and is trusted only as far
+ * as it stays within the ring.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/anon_inodes.h>
+#include <linux/eventfd.h>
+#include <linux/sched/signal.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+
+#include "proxyfd.h"
+#include "proxy.h"
+
+struct proxy_ring {
+	struct mutex             lock;     /* writers */
+	struct proxyfd_ring_ctl *ctl;
+	char                    *data;     /* data area twice, vmap-ed */
+	struct page            **pages;    /* control page, then data */
+	unsigned int             nr_pages; /* data pages */
+	u32                      size;
+	u64                      head;     /* what ctl->head should be */
+	wait_queue_head_t        rd_wait;
+	wait_queue_head_t        wr_wait;
+	struct eventfd_ctx      *eventfd;
+	atomic_t                 maps;     /* reader's mappings */
+	bool                     gone;     /* last one unmapped */
+};
+
+static const struct file_operations ring_fops;
+
+bool ring_file(struct file *filp)
+{
+	return filp->f_op == &ring_fops;
+}
+
+/* Bytes queued; more than size if the reader messed tail up. */
+static u64 ring_used(struct proxy_ring *ring)
+{
+	u64 used = READ_ONCE(ring->head) - READ_ONCE(ring->ctl->tail);
+
+	/* reader is done with the data before we reuse the room */
+	smp_mb();
+	return used;
+}
+
+static u64 ring_room(struct proxy_ring *ring)
+{
+	u64 used = ring_used(ring);
+
+	return used > ring->size ? 0 : ring->size - used;
+}
+
+static void ring_eventfd_signal(struct eventfd_ctx *ctx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+/* Frames published.  drained: the reader had consumed everything
+ * before, eventfd waiters may need a kick. */
+static void ring_wake_readers(struct proxy_ring *ring, bool drained)
+{
+	if (wq_has_sleeper(&ring->rd_wait))
+		wake_up_interruptible_poll(&ring->rd_wait,
+		                           EPOLLIN | EPOLLRDNORM);
+	if (drained && ring->eventfd)
+		ring_eventfd_signal(ring->eventfd);
+}
+
+/* Room made, or the reader gone.  Writers wait with NEED_WAKEUP set. */
+static void ring_wake_writers(struct proxy_ring *ring)
+{
+	WRITE_ONCE(ring->ctl->flags, 0);
+	wake_up_interruptible_poll(&ring->wr_wait, EPOLLOUT | EPOLLWRNORM);
+}
+
+/* Room for need bytes, or the reader gone?  If not, ask the reader for
+ * a wakeup, again after every one: it clears the flag. */
+static bool ring_wait_done(struct proxy_ring *ring, size_t need)
+{
+	if (READ_ONCE(ring->gone))
+		return true;
+	WRITE_ONCE(ring->ctl->flags, PROXYFD_RING_NEED_WAKEUP);
+	/* pairs with the reader: tail update, barrier, flags check */
+	smp_mb();
+	return ring_room(ring) >= need;
+}
+
+wait_queue_head_t *ring_waitq(struct proxy_ring *ring)
+{
+	return &ring->wr_wait;
+}
+
+size_t ring_framed_lowat_max(struct proxy_ctx *ctx, struct proxy_target *t)
+{
+	return t->ring->size - fhdr_size(ctx);
+}
+
+/* Writable if a frame of lowat bytes (1 if unset) fits.  If not, ask
+ * the reader for a wakeup.  Hung up once the reader is gone. */
+__poll_t ring_framed_poll(struct proxy_ctx *ctx, struct proxy_target *t)
+{
+	struct proxy_ring *ring = t->ring;
+	size_t need = fhdr_size(ctx) + max_t(u32, READ_ONCE(ctx->lowat), 1);
+
+	if (READ_ONCE(ring->gone))
+		return EPOLLOUT | EPOLLWRNORM | EPOLLERR | EPOLLHUP;
+	if (ring_room(ring) >= need || ring_wait_done(ring, need))
+		return EPOLLOUT | EPOLLWRNORM;
+	return 0;
+}
+
+/* A write is a single record, split into frames only if the header
+ * format demands.  It goes in whole or not at all: head moves once
+ * everything is copied. */
+ssize_t ring_framed_write(struct proxy_ctx *ctx, struct proxy_target *t,
+                          struct kiocb *iocb, struct iov_iter *from)
+{
+	struct proxy_ring *ring = t->ring;
+	bool nowait = iocb_nowait(iocb);
+	bool nonblock = nowait || (iocb->ki_filp->f_flags & O_NONBLOCK);
+	size_t len = iov_iter_count(from);
+	size_t frame_max = fhdr_frame_max(ctx);
+	size_t need, off, chars, copied;
+	unsigned int frames = 0;
+	bool drained = false;
+	u64 head, wait_start;
+	ssize_t ret;
+
+	/* Null write succeeds. */
+	if (unlikely(len == 0))
+		return 0;
+
+	if (ctx->max_atomic && len > ctx->max_atomic)
+		return -EMSGSIZE;
+
+	need = len + DIV_ROUND_UP(len, frame_max) * fhdr_size(ctx);
+	if (need > ring->size)
+		return -EMSGSIZE;
+
+	if (nowait) {
+		if (!mutex_trylock(&ring->lock)) {
+			proxy_stat_add(ctx, PROXY_STAT_EAGAIN, 1);
+			return -EAGAIN;
+		}
+	} else {
+		mutex_lock(&ring->lock);
+	}
+
+	for (;;) {
+		if (READ_ONCE(ring->gone)) {
+			send_sig(SIGPIPE, current, 0);
+			ret = -EPIPE;
+			goto out;
+		}
+		if (ring_used(ring) > ring->size) {
+			ret = -EIO;
+			goto out;
+		}
+		if (ring_room(ring) >= need)
+			break;
+		if (nonblock) {
+			proxy_stat_add(ctx, PROXY_STAT_EAGAIN, 1);
+			ret = -EAGAIN;
+			goto out;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		mutex_unlock(&ring->lock);
+		wait_start = ktime_get_ns();
+		wait_event_interruptible(ring->wr_wait,
+		                         ring_wait_done(ring, need));
+		proxy_stat_add(ctx, PROXY_STAT_WAIT_NS,
+		               ktime_get_ns() - wait_start);
+		mutex_lock(&ring->lock);
+	}
+
+	head = ring->head;
+	for (off = 0; off < len; off += chars) {
+		struct fhdr h;
+
+		chars = min(len - off, frame_max);
+		fhdr_make(ctx, NULL, &h, chars, off + chars < len);
+		memcpy(ring->data + (head & (ring->size - 1)), &h, h.size);
+		head += h.size;
+		copied = copy_from_iter(ring->data + (head & (ring->size - 1)),
+		                        chars, from);
+		if (unlikely(copied < chars)) {
+			iov_iter_revert(from, off + copied);
+			ret = -EFAULT;
+			goto out;
+		}
+		head += chars;
+		frames++;
+	}
+
+	/* frames first, then head */
+	smp_wmb();
+	WRITE_ONCE(ring->ctl->head, head);
+	/* pairs with the reader: tail update, barrier, head check */
+	smp_mb();
+	drained = READ_ONCE(ring->ctl->tail) == ring->head;
+	WRITE_ONCE(ring->head, head);
+	ret = len;
+out:
+	mutex_unlock(&ring->lock);
+	if (ret > 0) {
+		proxy_stat_add(ctx, PROXY_STAT_FRAMES, frames);
+		proxy_stat_add(ctx, PROXY_STAT_BYTES, ret);
+		ring_wake_readers(ring, drained);
+	}
+	return ret;
+}
+
+/* ring file methods */
+
+static __poll_t ring_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct proxy_ring *ring = filp->private_data;
+
+	poll_wait(filp, &ring->rd_wait, wait);
+
+	/* the reader is done with something, if writers wait */
+	if (READ_ONCE(ring->ctl->flags) & PROXYFD_RING_NEED_WAKEUP)
+		ring_wake_writers(ring);
+
+	if (READ_ONCE(ring->head) != READ_ONCE(ring->ctl->tail))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+static void ring_vm_flags_set(struct vm_area_struct *vma, unsigned long flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+	vm_flags_set(vma, flags);
+#else
+	vma->vm_flags |= flags;
+#endif
+}
+
+/* Mappings are the reader: once the last one is gone, writers get
+ * EPIPE, as with a pipe without readers. */
+static void ring_vm_open(struct vm_area_struct *vma)
+{
+	struct proxy_ring *ring = vma->vm_file->private_data;
+
+	atomic_inc(&ring->maps);
+}
+
+static void ring_vm_close(struct vm_area_struct *vma)
+{
+	struct proxy_ring *ring = vma->vm_file->private_data;
+
+	if (atomic_dec_and_test(&ring->maps)) {
+		WRITE_ONCE(ring->gone, true);
+		ring_wake_writers(ring);
+	}
+}
+
+static const struct vm_operations_struct ring_vm_ops = {
+	.open  = ring_vm_open,
+	.close = ring_vm_close,
+};
+
+/* Control page, then data pages twice. */
+static int ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct proxy_ring *ring = filp->private_data;
+	unsigned long addr = vma->vm_start;
+	unsigned int i;
+	int err;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start !=
+	    PROXYFD_RING_MMAP_SIZE(ring->size, PAGE_SIZE))
+		return -EINVAL;
+
+	/* tail updates must reach us */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	ring_vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+	err = vm_insert_page(vma, addr, ring->pages[0]);
+	for (i = 0; !err && i < 2 * ring->nr_pages; i++) {
+		addr += PAGE_SIZE;
+		err = vm_insert_page(vma, addr,
+		                     ring->pages[1 + i % ring->nr_pages]);
+	}
+	if (err)
+		return err;
+	vma->vm_ops = &ring_vm_ops;
+	ring_vm_open(vma);
+	return 0;
+}
+
+static long ring_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct proxy_ring *ring = filp->private_data;
+
+	switch (cmd) {
+	case PROXYFD_IOC_RING_WAKE:
+		ring_wake_writers(ring);
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+static void ring_free(struct proxy_ring *ring)
+{
+	unsigned int i;
+
+	if (ring->data)
+		vunmap(ring->data);
+	for (i = 0; i < 1 + ring->nr_pages; i++)
+		if (ring->pages[i])
+			put_page(ring->pages[i]);
+	kvfree(ring->pages);
+	if (ring->eventfd)
+		eventfd_ctx_put(ring->eventfd);
+	kfree(ring);
+}
+
+static int ring_release(struct inode *inode, struct file *filp)
+{
+	ring_free(filp->private_data);
+	return 0;
+}
+
+static const struct file_operations ring_fops = {
+	.owner = THIS_MODULE,
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,12,0)
+	.llseek	        = no_llseek,
+#endif
+	.poll           = ring_poll,
+	.mmap           = ring_mmap,
+	.unlocked_ioctl = ring_ioctl,
+	.compat_ioctl   = ring_ioctl,
+	.release        = ring_release,
+};
+
+/* control device */
+
+static int ring_map(struct proxy_ring *ring)
+{
+	struct page **map;
+	unsigned int i;
+
+	map = kvmalloc_array(2 * ring->nr_pages, sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+	for (i = 0; i < 2 * ring->nr_pages; i++)
+		map[i] = ring->pages[1 + i % ring->nr_pages];
+	ring->data = vmap(map, 2 * ring->nr_pages, VM_MAP, PAGE_KERNEL);
+	kvfree(map);
+
+	return ring->data ? 0 : -ENOMEM;
+}
+
+int ring_create(const struct proxyfd_ring_req *r)
+{
+	struct proxy_ring *ring;
+	struct file *file;
+	unsigned int i;
+	int fd, rc;
+
+	if (r->flags & ~(__u32)O_CLOEXEC || r->pad)
+		return -EINVAL;
+
+	if (r->size < PAGE_SIZE || r->size > PROXYFD_RING_SIZE_MAX ||
+	    !is_power_of_2(r->size))
+		return -EINVAL;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL_ACCOUNT);
+	if (!ring)
+		return -ENOMEM;
+
+	mutex_init(&ring->lock);
+	init_waitqueue_head(&ring->rd_wait);
+	init_waitqueue_head(&ring->wr_wait);
+	ring->size = r->size;
+	ring->nr_pages = r->size >> PAGE_SHIFT;
+
+	rc = -ENOMEM;
+	ring->pages = kvmalloc_array(1 + ring->nr_pages, sizeof(*ring->pages),
+	                             GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+	if (!ring->pages) {
+		kfree(ring);
+		return rc;
+	}
+
+	ring->pages[0] = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+	if (!ring->pages[0])
+		goto error_free;
+	for (i = 1; i < 1 + ring->nr_pages; i++) {
+		ring->pages[i] = alloc_page(GFP_HIGHUSER | __GFP_ACCOUNT |
+		                            __GFP_ZERO);
+		if (!ring->pages[i])
+			goto error_free;
+	}
+
+	rc = ring_map(ring);
+	if (rc)
+		goto error_free;
+
+	ring->ctl = page_address(ring->pages[0]);
+	ring->ctl->size = ring->size;
+
+	if (r->eventfd >= 0) {
+		ring->eventfd = eventfd_ctx_fdget(r->eventfd);
+		if (IS_ERR(ring->eventfd)) {
+			rc = PTR_ERR(ring->eventfd);
+			ring->eventfd = NULL;
+			goto error_free;
+		}
+	}
+
+	fd = get_unused_fd_flags(r->flags & O_CLOEXEC);
+	if (fd < 0) {
+		rc = fd;
+		goto error_free;
+	}
+
+	file = anon_inode_getfile("[proxyfd-ring]", &ring_fops, ring,
+	                          O_RDWR | (r->flags & O_CLOEXEC));
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		rc = PTR_ERR(file);
+		goto error_free;
+	}
+
+	fd_install(fd, file);
+	return fd;
+
+error_free:
+	ring_free(ring);
+	return rc;
+}
@@ -0,0 +1,120 @@
+/* Usage: stress [COUNT]
+ *
+ * Create COUNT proxies (1M by default) on a single pipe, then close them;
+ * reports the rate of both and the memory taken per proxy.  Needs
+ * RLIMIT_NOFILE (and fs.nr_open) above COUNT, raised here if allowed.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <errno.h>
+
+#include "src/proxyfd.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* MemAvailable from /proc/meminfo, KiB */
+static long mem_available(void)
+{
+	char line[128];
+	long kb = -1;
+	FILE *f = fopen("/proc/meminfo", "r");
+
+	if (!f)
+		err(EXIT_FAILURE, "/proc/meminfo");
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "MemAvailable: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+int main(int argc, char **argv)
+{
+	static struct proxyfd_req reqs[PROXYFD_BATCH_MAX];
+	long count = argc > 1 ? atol(argv[1]) : 1000000;
+	struct proxyfd_batch batch = {
+		.size = sizeof(struct proxyfd_req),
+		.reqs = (uintptr_t)reqs,
+	};
+	struct rlimit rl = { count + 64, count + 64 };
+	int devfd, pipefd[2], *fds;
+	long created = 0, i, mem0, mem1;
+	double t0, t1, t2;
+
+	if (count <= 0)
+		errx(EXIT_FAILURE, "bad count");
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		warn("setrlimit(%ld), going on with the current limit",
+		     (long)rl.rlim_cur);
+
+	fds = calloc(count, sizeof(*fds));
+	if (!fds)
+		err(EXIT_FAILURE, "calloc");
+
+	devfd = open(PROXYFD_DEV_PATH, O_WRONLY);
+	if (devfd < 0)
+		err(EXIT_FAILURE, "open(%s)", PROXYFD_DEV_PATH);
+	if (pipe(pipefd))
+		err(EXIT_FAILURE, "pipe");
+
+	for (i = 0; i < PROXYFD_BATCH_MAX; i++) {
+		reqs[i].flags = O_CLOEXEC;
+		reqs[i].pipefd = pipefd[1];
+	}
+
+	mem0 = mem_available();
+	t0 = now();
+	while (created < count) {
+		long n = count - created, ok;
+
+		batch.count = n < PROXYFD_BATCH_MAX ? n : PROXYFD_BATCH_MAX;
+		ok = ioctl(devfd, PROXYFD_IOC_CREATE, &batch);
+		if (ok < 0)
+			err(EXIT_FAILURE, "PROXYFD_IOC_CREATE");
+		for (i = 0; i < batch.count; i++)
+			if (reqs[i].result >= 0)
+				fds[created++] = reqs[i].result;
+		if (ok < batch.count) {
+			for (i = 0; reqs[i].result >= 0; i++)
+				;
+			warnx("stopped at %ld proxies: %s", created,
+			      strerror(-reqs[i].result));
+			break;
+		}
+	}
+	t1 = now();
+	mem1 = mem_available();
+
+	for (i = 0; i < created; i++)
+		close(fds[i]);
+	t2 = now();
+
+	printf("created %ld proxies in %.3fs, %.0f/s\n",
+	       created, t1 - t0, created / (t1 - t0));
+	printf("closed in %.3fs, %.0f/s\n", t2 - t1, created / (t2 - t1));
+	if (created && mem0 >= 0 && mem1 >= 0)
+		printf("memory: %ld KiB, %ld bytes per proxy\n", mem0 - mem1,
+		       (mem0 - mem1) * 1024 / created);
+
+	free(fds);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(devfd);
+	return 0;
+}
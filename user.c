@@ -11,23 +11,82 @@
 #include <string.h>
 #include <err.h>
 #include <errno.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
-struct request {
-	uint32_t flags;    /* O_CLOEXEC, O_NONBLOCK */
-	uint32_t cookie;
-	uint32_t pipefd;
-};
+#include "src/proxyfd.h"
+
+/* "key:\tvalue" line of a stats file, -1 if it's not there */
+static long long counter(const char *path, const char *key)
+{
+	size_t n = strlen(key);
+	long long v = -1;
+	char line[128];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, key, n) && line[n] == ':')
+			v = strtoll(line + n + 1, NULL, 10);
+	fclose(f);
+	return v;
+}
+
+/* proxy's counter in fdinfo */
+static long long fdinfo(int fd, const char *key)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+	return counter(path, key);
+}
+
+/* Drain a non-blocking pipe fed by V0 proxies.  Frames are described in
+ * s as their length and first byte, e.g. "13H 26l".  Returns the number
+ * of frames, -1 if the data ends amid one. */
+static int drain(int fd, char *s, size_t size)
+{
+	static char data[1 << 20];
+	size_t len = 0, off = 0, n;
+	uint32_t hdr;
+	ssize_t st;
+	int frames = 0;
+
+	while ((st = read(fd, data + len, sizeof(data) - len)) > 0)
+		len += st;
+	*s = 0;
+	while (off < len) {
+		if (len - off < sizeof(hdr))
+			return -1;
+		memcpy(&hdr, data + off, sizeof(hdr));
+		n = be32toh(hdr) & 0xffff;
+		off += sizeof(hdr);
+		if (len - off < n)
+			return -1;
+		snprintf(s + strlen(s), size - strlen(s), "%s%zu%c",
+		         frames++ ? " " : "", n, n ? data[off] : '-');
+		off += n;
+	}
+	return frames;
+}
 
 int main()
 {
+	static const char m1[] = "Hello, world!",
+	                  m2[] = "lorem ipsum dolor sit amet";
 	ssize_t st;
 	int devfd, pipefd[2], proxyfd;
-	struct request r = {};
+	struct proxy_req r = {};
 	char buf[128];
 
-	devfd = open("/dev/proxyfd", O_WRONLY);
+	devfd = open(PROXYFD_DEV_PATH, O_WRONLY);
 	if (devfd < 0)
-		err(EXIT_FAILURE, "open(/dev/proxyfd)");
+		err(EXIT_FAILURE, "open(%s)", PROXYFD_DEV_PATH);
 
 	if (pipe(pipefd))
 		err(EXIT_FAILURE, "pipe");
@@ -70,6 +129,428 @@ int main()
 	printf("create with unexpected file kind (2): %s\n",
 	       strerror(errno));
 
+	/* batch: one with padding set (refused), one fine, one bad */
+	struct proxyfd_req reqs[3] = {
+		{ .flags = O_CLOEXEC, .pipefd = pipefd[1], .pad = 1 },
+		{ .flags = O_CLOEXEC, .pipefd = pipefd[1] },
+		{ .flags = O_CLOEXEC, .pipefd = pipefd[0] },
+	};
+	struct proxyfd_batch batch = {
+		.count = 3, .size = sizeof(reqs[0]),
+		.reqs = (uintptr_t)reqs,
+	};
+
+	st = ioctl(devfd, PROXYFD_IOC_CREATE, &batch);
+	if (st >= 0)
+		errno = 0;
+	printf("batch created %d proxies: %s\n", (int)st, strerror(errno));
+	for (int i = 0; i < 3; i++) {
+		printf("batch entry %d: %s\n", i,
+		       reqs[i].result < 0 ? strerror(-reqs[i].result) :
+		       "created");
+		if (reqs[i].result >= 0)
+			close(reqs[i].result);
+	}
+
+	/* atomic mode: writes above max_atomic are refused */
+	struct proxyfd_req ar = {
+		.flags = O_CLOEXEC, .pipefd = pipefd[1],
+		.mode = PROXYFD_MODE_ATOMIC, .max_atomic = 16,
+	};
+	batch.count = 1;
+	batch.reqs = (uintptr_t)&ar;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || ar.result < 0)
+		err(EXIT_FAILURE, "atomic proxy");
+
+	st = write(ar.result, m1, sizeof(m1) - 1);
+	if (st >= 0)
+		errno = 0;
+	printf("write above max_atomic yields %d: %s\n",
+	       (int)st, strerror(errno));
+	close(ar.result);
+
+	/* v1 header: full length and a stream id */
+	int v1pipe[2];
+	struct proxyfd_hdr_v1 h;
+	struct proxyfd_req vr = {
+		.flags = O_CLOEXEC,
+		.hdr = PROXYFD_HDR_V1, .stream = 42,
+	};
+	if (pipe(v1pipe))
+		err(EXIT_FAILURE, "pipe");
+	vr.pipefd = v1pipe[1];
+	batch.reqs = (uintptr_t)&vr;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "v1 proxy");
+
+	if (write(vr.result, m2, sizeof(m2) - 1) != sizeof(m2) - 1)
+		err(EXIT_FAILURE, "write");
+	if (read(v1pipe[0], &h, sizeof(h)) != sizeof(h))
+		err(EXIT_FAILURE, "read");
+	printf("v1 header: version %u, len %u, stream %llu\n",
+	       PROXYFD_HDR_VERSION(be32toh(h.info)), be32toh(h.len),
+	       (unsigned long long)be64toh(h.stream));
+	if (read(v1pipe[0], buf, be32toh(h.len)) != be32toh(h.len))
+		err(EXIT_FAILURE, "read");
+	close(vr.result);
+
+	/* stamped frames, sequence shared by proxies of the pipe */
+	struct proxyfd_hdr_ts ts;
+	vr.mode = PROXYFD_MODE_TS;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "ts proxy");
+	for (int i = 0; i < 2; i++) {
+		if (write(vr.result, m1, sizeof(m1) - 1) != sizeof(m1) - 1)
+			err(EXIT_FAILURE, "write");
+		if (read(v1pipe[0], &h, sizeof(h)) != sizeof(h) ||
+		    read(v1pipe[0], &ts, sizeof(ts)) != sizeof(ts) ||
+		    read(v1pipe[0], buf, be32toh(h.len)) != be32toh(h.len))
+			err(EXIT_FAILURE, "read");
+		printf("ts frame: flags %x, seq %llu\n",
+		       be32toh(h.info) & 0xffffff,
+		       (unsigned long long)be64toh(ts.seq));
+	}
+	close(vr.result);
+	close(v1pipe[0]);
+	close(v1pipe[1]);
+
+	/* ring: frames show up in the mapping */
+	struct proxyfd_ring_req rq = { .size = 4096, .flags = O_CLOEXEC,
+	                               .eventfd = -1 };
+	int ringfd = ioctl(devfd, PROXYFD_IOC_RING_CREATE, &rq);
+	if (ringfd < 0)
+		err(EXIT_FAILURE, "ring");
+
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+	char *map = mmap(NULL, PROXYFD_RING_MMAP_SIZE(rq.size, pgsz),
+	                 PROT_READ | PROT_WRITE, MAP_SHARED, ringfd, 0);
+	if (map == MAP_FAILED)
+		err(EXIT_FAILURE, "mmap");
+	struct proxyfd_ring_ctl *ctl = (void *)map;
+
+	vr.pipefd = ringfd;
+	vr.mode = 0;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "ring proxy");
+	if (write(vr.result, m1, sizeof(m1) - 1) != sizeof(m1) - 1)
+		err(EXIT_FAILURE, "write");
+
+	memcpy(&h, map + pgsz + ctl->tail % ctl->size, sizeof(h));
+	printf("ring: head %llu, frame len %u: '%.*s'\n",
+	       (unsigned long long)ctl->head, be32toh(h.len),
+	       (int)be32toh(h.len), map + pgsz + sizeof(h));
+	ctl->tail = ctl->head;
+	close(vr.result);
+	munmap(map, PROXYFD_RING_MMAP_SIZE(rq.size, pgsz));
+	close(ringfd);
+
+	/* sharded: round-robin over two pipes */
+	int sp[2][2];
+	__s32 sfds[2];
+	for (int i = 0; i < 2; i++) {
+		if (pipe2(sp[i], O_NONBLOCK))
+			err(EXIT_FAILURE, "pipe");
+		sfds[i] = sp[i][1];
+	}
+	vr.shard = PROXYFD_SHARD_RR;
+	vr.npipes = 2;
+	vr.pipefds = (uintptr_t)sfds;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "sharded proxy");
+	for (int i = 0; i < 4; i++)
+		if (write(vr.result, m1, sizeof(m1) - 1) != sizeof(m1) - 1)
+			err(EXIT_FAILURE, "write");
+	for (int i = 0; i < 2; i++) {
+		st = read(sp[i][0], buf, sizeof(buf));
+		printf("shard %d: %d bytes\n", i, (int)st);
+	}
+	close(vr.result);
+
+	/* fan-out: every pipe gets the frame */
+	vr.shard = PROXYFD_SHARD_TEE;
+	vr.mode = PROXYFD_MODE_TEE_DROP;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "fan-out proxy");
+	if (write(vr.result, m2, sizeof(m2) - 1) != sizeof(m2) - 1)
+		err(EXIT_FAILURE, "write");
+	for (int i = 0; i < 2; i++) {
+		st = read(sp[i][0], buf, sizeof(buf));
+		printf("tee %d: %d bytes: '%.*s'\n", i, (int)st,
+		       st > (ssize_t)sizeof(h) ? (int)(st - sizeof(h)) : 0,
+		       buf + sizeof(h));
+		close(sp[i][0]);
+		close(sp[i][1]);
+	}
+	close(vr.result);
+	vr.shard = 0;
+	vr.npipes = 0;
+	vr.mode = 0;
+
+	/* weighted: a flood stays within its share of the pipe */
+	static char big[4000];
+	int wp[2], fair[2];
+	if (pipe2(wp, O_NONBLOCK))
+		err(EXIT_FAILURE, "pipe");
+	vr.pipefd = wp[1];
+	vr.hdr = PROXYFD_HDR_V0;
+	vr.stream = 0;
+	for (int i = 0; i < 2; i++) {
+		vr.weight = i ? 1 : 3;
+		if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 ||
+		    vr.result < 0)
+			err(EXIT_FAILURE, "weighted proxy");
+		fair[i] = vr.result;
+	}
+	int nw = 0;
+	while (write(fair[0], big, sizeof(big)) == sizeof(big))
+		nw++;
+	printf("weighted: heavy proxy wrote %d buffers (%s), ", nw,
+	       strerror(errno));
+	st = write(fair[1], m1, sizeof(m1) - 1);
+	printf("light proxy write: %d\n", (int)st);
+	close(fair[0]);
+	close(fair[1]);
+	close(wp[0]);
+	close(wp[1]);
+	vr.weight = 0;
+
+	/* retarget: the proxy moves on to another pipe */
+	int rp[2][2];
+	for (int i = 0; i < 2; i++)
+		if (pipe2(rp[i], O_NONBLOCK))
+			err(EXIT_FAILURE, "pipe");
+	vr.pipefd = rp[0][1];
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "proxy");
+	if (write(vr.result, m1, sizeof(m1) - 1) != sizeof(m1) - 1)
+		err(EXIT_FAILURE, "write");
+	struct proxyfd_retarget rt = { .pipefd = rp[1][1] };
+	if (ioctl(vr.result, PROXYFD_IOC_RETARGET, &rt))
+		err(EXIT_FAILURE, "retarget");
+	if (write(vr.result, m2, sizeof(m2) - 1) != sizeof(m2) - 1)
+		err(EXIT_FAILURE, "write");
+	for (int i = 0; i < 2; i++) {
+		st = read(rp[i][0], buf, sizeof(buf));
+		printf("retarget, pipe %d: %d bytes\n", i, (int)st);
+		close(rp[i][0]);
+		close(rp[i][1]);
+	}
+	close(vr.result);
+
+	/* zero-copy: the writer's pages go into the pipe */
+	int zp[2];
+	if (pipe2(zp, O_NONBLOCK))
+		err(EXIT_FAILURE, "pipe");
+	fcntl(zp[1], F_SETPIPE_SZ, 1 << 20);
+	char *zbuf = mmap(NULL, PROXYFD_ZEROCOPY_MIN, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (zbuf == MAP_FAILED)
+		err(EXIT_FAILURE, "mmap");
+	memset(zbuf, 'z', PROXYFD_ZEROCOPY_MIN);
+	vr.pipefd = zp[1];
+	vr.hdr = PROXYFD_HDR_V1;
+	vr.mode = PROXYFD_MODE_ZEROCOPY;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "zero-copy proxy");
+	st = write(vr.result, zbuf, PROXYFD_ZEROCOPY_MIN);
+	printf("zero-copy write: %d bytes, ", (int)st);
+	size_t zlen = 0;
+	int zframes = 0;
+	while (read(zp[0], &h, sizeof(h)) == sizeof(h)) {
+		for (size_t left = be32toh(h.len); left; ) {
+			st = read(zp[0], buf, left < sizeof(buf) ?
+			                      left : sizeof(buf));
+			if (st <= 0 || memchr(buf, 'z', st) != buf)
+				err(EXIT_FAILURE, "zero-copy read");
+			left -= st;
+			zlen += st;
+		}
+		zframes++;
+	}
+	printf("read %zu bytes in %d frames\n", zlen, zframes);
+	close(vr.result);
+	close(zp[0]);
+	close(zp[1]);
+
+	/* large buffers: a frame per 64KiB rather than per page */
+	if (pipe2(zp, O_NONBLOCK))
+		err(EXIT_FAILURE, "pipe");
+	vr.pipefd = zp[1];
+	vr.mode = PROXYFD_MODE_LARGEBUF;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "large buffer proxy");
+	st = write(vr.result, zbuf, PROXYFD_ZEROCOPY_MIN);
+	printf("large buffers: wrote %d bytes, frames:", (int)st);
+	while (read(zp[0], &h, sizeof(h)) == sizeof(h)) {
+		printf(" %u", be32toh(h.len));
+		for (size_t left = be32toh(h.len); left; left -= st)
+			if ((st = read(zp[0], buf, left < sizeof(buf) ?
+			                           left : sizeof(buf))) <= 0)
+				err(EXIT_FAILURE, "read");
+	}
+	printf("\n");
+	munmap(zbuf, PROXYFD_ZEROCOPY_MIN);
+	close(vr.result);
+	close(zp[0]);
+	close(zp[1]);
+	vr.mode = 0;
+
+	/* batch reader: whole frames, headers parsed */
+	if (pipe(zp))
+		err(EXIT_FAILURE, "pipe");
+	vr.pipefd = zp[1];
+	vr.hdr = PROXYFD_HDR_V0;
+	vr.cookie = htobe32(0x21000000);
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "proxy");
+	for (int i = 0; i < 3; i++)
+		if (write(vr.result, i == 1 ? m2 : m1,
+		          (i == 1 ? sizeof(m2) : sizeof(m1)) - 1) < 0)
+			err(EXIT_FAILURE, "write");
+	struct proxyfd_frame frames[8];
+	struct proxyfd_recv rv = {
+		.pipefd = zp[0], .hdr = PROXYFD_HDR_V0,
+		.frames = (uintptr_t)frames, .nframes = 8,
+		.buf = (uintptr_t)buf, .buflen = sizeof(buf),
+		.flags = PROXYFD_RECV_NONBLOCK,
+	};
+	st = ioctl(devfd, PROXYFD_IOC_RECV, &rv);
+	printf("recv: %d frames, %u bytes:", (int)st, rv.buflen);
+	for (int i = 0; i < (int)st; i++)
+		printf(" %08x '%.*s'", be32toh(frames[i].cookie),
+		       (int)frames[i].len, buf + frames[i].offset);
+	printf("\n");
+	close(vr.result);
+	close(zp[0]);
+	close(zp[1]);
+	vr.cookie = 0;
+
+	/* writev in IOVEC mode: a group doesn't go in piecemeal */
+	static char iovb[3][3000];
+	char *fill = malloc(14 * pgsz);
+	struct iovec iov[3];
+	int avail;
+	if (!fill)
+		err(EXIT_FAILURE, "malloc");
+	if (pipe2(zp, O_NONBLOCK))
+		err(EXIT_FAILURE, "pipe");
+	vr.pipefd = zp[1];
+	vr.mode = PROXYFD_MODE_IOVEC;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "iovec proxy");
+	if (write(zp[1], fill, 14 * pgsz) != 14 * pgsz)
+		err(EXIT_FAILURE, "write");
+	for (int i = 0; i < 3; i++) {
+		memset(iovb[i], 'a' + i, sizeof(iovb[i]));
+		iov[i].iov_base = iovb[i];
+		iov[i].iov_len = sizeof(iovb[i]);
+	}
+	st = writev(vr.result, iov, 3);
+	if (st >= 0)
+		errno = 0;
+	ioctl(zp[0], FIONREAD, &avail);
+	printf("iovec group, room for two of three: %d (%s), %d bytes queued\n",
+	       (int)st, strerror(errno), avail);
+	if (read(zp[0], fill, 14 * pgsz) != 14 * pgsz)
+		err(EXIT_FAILURE, "read");
+	st = writev(vr.result, iov, 3);
+	if (st >= 0)
+		errno = 0;
+	printf("iovec group, empty pipe: %d (%s), ", (int)st, strerror(errno));
+	st = drain(zp[0], buf, sizeof(buf));
+	printf("%d frames: %s\n", (int)st, buf);
+	close(vr.result);
+	close(zp[0]);
+	close(zp[1]);
+	vr.mode = 0;
+
+	/* packed: frames run on into the next buffer, the second one's
+	 * header split between two */
+	if (pipe2(zp, O_NONBLOCK))
+		err(EXIT_FAILURE, "pipe");
+	vr.pipefd = zp[1];
+	vr.mode = PROXYFD_MODE_PACKED;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "packed proxy");
+	memset(fill, 'p', 14 * pgsz);
+	size_t plen[3] = { pgsz - 6, 10, 5000 };
+	for (int i = 0; i < 3; i++)
+		if (write(vr.result, fill, plen[i]) != (ssize_t)plen[i])
+			err(EXIT_FAILURE, "write");
+	st = drain(zp[0], buf, sizeof(buf));
+	printf("packed: %d frames: %s, merged %lld, newbufs %lld\n",
+	       (int)st, buf, fdinfo(vr.result, "merged"),
+	       fdinfo(vr.result, "newbufs"));
+	close(vr.result);
+	close(zp[0]);
+	close(zp[1]);
+	vr.mode = 0;
+
+	/* per-CPU staging: a proxy's frames keep their order, also with
+	 * a splice and a record too large to stage in between */
+	int sf[2];
+	if (pipe2(zp, O_NONBLOCK) || pipe(sf))
+		err(EXIT_FAILURE, "pipe");
+	vr.pipefd = zp[1];
+	vr.mode = PROXYFD_MODE_PERCPU;
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "percpu proxy");
+	memset(fill, 'e', pgsz);
+	if (write(vr.result, "a", 1) != 1 || write(vr.result, "b", 1) != 1 ||
+	    write(sf[1], "c", 1) != 1 ||
+	    splice(sf[0], NULL, vr.result, NULL, 1, 0) != 1 ||
+	    write(vr.result, "d", 1) != 1 ||
+	    write(vr.result, fill, pgsz) != pgsz ||
+	    write(vr.result, "f", 1) != 1)
+		err(EXIT_FAILURE, "write");
+	if (ioctl(vr.result, PROXYFD_IOC_FLUSH))
+		err(EXIT_FAILURE, "flush");
+	st = drain(zp[0], buf, sizeof(buf));
+	printf("percpu: %d frames: %s\n", (int)st, buf);
+	close(sf[0]);
+	close(sf[1]);
+
+	/* closing it with a frame staged for a full pipe doesn't wait for
+	 * the reader, nor is the frame lost */
+	size_t nfill = 0;
+	while ((st = write(zp[1], fill, pgsz)) > 0)
+		nfill += st;
+	if (write(vr.result, "g", 1) != 1)
+		err(EXIT_FAILURE, "write");
+	if (!close(vr.result))
+		errno = 0;
+	printf("closing percpu proxy, pipe full: %s, ", strerror(errno));
+	fcntl(zp[0], F_SETFL, 0);
+	for (size_t left = nfill; left; left -= st)
+		if ((st = read(zp[0], fill, left < pgsz ? left : pgsz)) <= 0)
+			err(EXIT_FAILURE, "read");
+	st = read(zp[0], buf, sizeof(buf));
+	printf("then %d bytes: '%c'\n", (int)st, st == 5 ? buf[4] : '-');
+	close(zp[0]);
+	close(zp[1]);
+	vr.mode = 0;
+
+	/* page pool: the pipe's pages come back for its next frames; the
+	 * first one is kept by the pipe itself */
+	long long recycled[2];
+	if (pipe2(zp, O_NONBLOCK))
+		err(EXIT_FAILURE, "pipe");
+	vr.pipefd = zp[1];
+	if (ioctl(devfd, PROXYFD_IOC_CREATE, &batch) != 1 || vr.result < 0)
+		err(EXIT_FAILURE, "pool proxy");
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < 8; i++)
+			if (write(vr.result, fill, pgsz - 96) != pgsz - 96)
+				err(EXIT_FAILURE, "write");
+		st = drain(zp[0], buf, sizeof(buf));
+		recycled[round] = fdinfo(vr.result, "recycled");
+	}
+	printf("pool: %d frames, recycled %lld then %lld\n", (int)st,
+	       recycled[0], recycled[1]);
+	close(vr.result);
+	close(zp[0]);
+	close(zp[1]);
+
 	/* Cleanup */
 	close(devfd);
 
@@ -80,8 +561,6 @@ int main()
 	printf("closing pipe write end: %s\n", strerror(errno));
 
 	/* Check that writes are accepted. */
-	static const char m1[] = "Hello, world!",
-	                  m2[] = "lorem ipsum dolor sit amet";
 
 	st = write(proxyfd, m1, sizeof(m1) - 1);
 	if (st >= 0)
@@ -97,6 +576,57 @@ int main()
 	       (int)st, sizeof(m2) - 1,
 	       m2, strerror(errno));
 
+	/* Counters: the second frame shares a buffer with the first */
+	printf("proxy counters: bytes %lld, frames %lld, merged %lld, "
+	       "newbufs %lld\n", fdinfo(proxyfd, "bytes"),
+	       fdinfo(proxyfd, "frames"), fdinfo(proxyfd, "merged"),
+	       fdinfo(proxyfd, "newbufs"));
+	printf("debugfs: proxies %lld\n",
+	       counter("/sys/kernel/debug/proxyfd/stats", "proxies"));
+
+	/* Check that poll reports an empty pipe as writable. */
+	uint32_t lowat = 64;
+	struct pollfd pfd = { .fd = proxyfd, .events = POLLOUT };
+
+	if (!ioctl(proxyfd, PROXYFD_IOC_SET_LOWAT, &lowat))
+		errno = 0;
+	printf("set lowat on proxy: %s\n", strerror(errno));
+
+	st = poll(&pfd, 1, 0);
+	if (st >= 0)
+		errno = 0;
+	printf("poll on proxy yields %d, %s: %s\n", (int)st,
+	       pfd.revents & POLLOUT ? "writable" : "not writable",
+	       strerror(errno));
+
+	/* Deferred wakeups: set a policy, flush, turn it off again */
+	struct proxyfd_wakeup wk = { .bytes = 4096, .delay_us = 1000 };
+
+	if (!ioctl(proxyfd, PROXYFD_IOC_SET_WAKEUP, &wk) &&
+	    !ioctl(proxyfd, PROXYFD_IOC_FLUSH))
+		errno = 0;
+	printf("set wakeup policy and flush: %s\n", strerror(errno));
+	wk.bytes = wk.delay_us = 0;
+	if (ioctl(proxyfd, PROXYFD_IOC_SET_WAKEUP, &wk))
+		err(EXIT_FAILURE, "wakeup policy");
+
+	/* Check that splice into proxy works. */
+	int srcfd[2];
+	if (pipe(srcfd))
+		err(EXIT_FAILURE, "pipe");
+	if (write(srcfd[1], m1, sizeof(m1) - 1) != sizeof(m1) - 1)
+		err(EXIT_FAILURE, "write");
+
+	st = splice(srcfd[0], NULL, proxyfd, NULL, sizeof(buf), 0);
+	if (st >= 0)
+		errno = 0;
+	printf("spliced %d of %zu bytes of '%s' into proxy: %s\n",
+	       (int)st, sizeof(m1) - 1,
+	       m1, strerror(errno));
+
+	close(srcfd[0]);
+	close(srcfd[1]);
+
 	/* Check that read on proxy fails, since the corresponding
 	 * pipe end is wr-only */
 	st = read(proxyfd, buf, sizeof(buf));